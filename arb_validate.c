@@ -0,0 +1,144 @@
+/**
+ * @file arb_validate.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Check that a high-priority bus arbiter client sees bounded queueing
+ * delay while a low-priority client sweeps every lux sensor on the bus
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "tsl2561.h"
+#include "tsl2561_topo.h"
+#include "i2carb.h"
+
+#define eprintf(str, ...) \
+    fprintf(stderr, "%s, %d: " str "\n", __func__, __LINE__, ##__VA_ARGS__); \
+    fflush(stderr)
+
+#define ARB_VALIDATE_BOUND_US (2000)  ///< Default bound on the high-priority max_wait_us
+#define ARB_VALIDATE_PERIOD_US (2000) ///< Interval between high-priority transfers
+#define ARB_VALIDATE_XFERS (1000)     ///< High-priority transfers issued
+
+typedef struct
+{
+    i2carb_client *cl;
+    tsl2561_sched_dev *ents;
+    int num;
+    volatile int stop;
+    uint64_t sweeps;
+    uint64_t errors;
+} arb_validate_sweep;
+
+/**
+ * @brief Back-to-back full lux sweeps on the low-priority client, so that a
+ * low-priority transfer is queued or in flight at all times
+ *
+ */
+static void *sweep_thread(void *arg)
+{
+    arb_validate_sweep *sw = (arb_validate_sweep *)arg;
+    while (!sw->stop)
+    {
+        for (int i = 0; i < sw->num; i++)
+        {
+            uint32_t measure;
+            if (tsl2561_measure_arb(sw->ents[i].dev, sw->cl, sw->ents[i].chn, 0, &measure) < 0)
+                sw->errors++;
+        }
+        sw->sweeps++;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3)
+    {
+        printf("Invocation: sudo ./%s <I2C Bus Number> [Bound in us]\n\n", argv[0]);
+        return 0;
+    }
+    int bus = atoi(argv[1]);
+    uint64_t bound_us = argc == 3 ? strtoull(argv[2], NULL, 10) : ARB_VALIDATE_BOUND_US;
+    int ret = 1;
+    tsl2561 lux[TSL2561_TOPO_MAX];
+    tsl2561_sched_dev ent[TSL2561_TOPO_MAX];
+    tsl2561_topo topo[1];
+    tca9458a mux[1];
+    i2carb arb[1];
+    i2carb_client boot[1], lo[1], hi[1];
+    if (tca9458a_init(mux, bus, 0x70, 0) < 0)
+    {
+        eprintf("Could not initialize mux");
+        return 1;
+    }
+    if (i2carb_init(arb, mux) < 0)
+        goto err_close_mux;
+    i2carb_client_init(boot, arb, I2CARB_PRIO_LOW);
+    if (tsl2561_topo_discover(topo, mux, boot, bus, 0x70, TSL2561_TOPO_CACHE, 0) < 0)
+    {
+        eprintf("Could not discover devices");
+        goto err_stop_arb;
+    }
+    int num = tsl2561_topo_open(topo, mux, boot, lux, ent);
+    if (num <= 0)
+    {
+        eprintf("Could not open any device");
+        goto err_stop_arb;
+    }
+    i2carb_client_init(lo, arb, I2CARB_PRIO_LOW);
+    i2carb_client_init(hi, arb, I2CARB_PRIO_HIGH);
+    arb_validate_sweep sw = {lo, ent, num, 0, 0, 0};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &sweep_thread, &sw) != 0)
+    {
+        eprintf("Could not start sweep thread");
+        goto err_close_dev;
+    }
+    uint64_t max_lat_us = 0;
+    for (int i = 0; i < ARB_VALIDATE_XFERS; i++)
+    {
+        usleep(ARB_VALIDATE_PERIOD_US);
+        uint64_t start = i2carb_now_us();
+        tsl2561_probe_arb(ent[0].dev, hi, ent[0].chn);
+        uint64_t lat = i2carb_now_us() - start;
+        if (lat > max_lat_us)
+            max_lat_us = lat;
+    }
+    sw.stop = 1;
+    pthread_join(thread, NULL);
+
+    i2carb_client hs, ls;
+    i2carb_client_stats(hi, &hs);
+    i2carb_client_stats(lo, &ls);
+    printf("Sweeps: %llu (%llu errors), low priority: %llu xfers, %llu merged, max wait %llu us, occupancy %.3f\n",
+           (unsigned long long)sw.sweeps, (unsigned long long)sw.errors,
+           (unsigned long long)ls.xfers, (unsigned long long)ls.merged,
+           (unsigned long long)ls.max_wait_us, i2carb_client_occupancy(lo));
+    printf("High priority: %llu xfers, %llu errors, mean wait %llu us, max wait %llu us, max latency %llu us\n",
+           (unsigned long long)hs.xfers, (unsigned long long)hs.errors,
+           (unsigned long long)(hs.xfers ? hs.wait_us / hs.xfers : 0),
+           (unsigned long long)hs.max_wait_us, (unsigned long long)max_lat_us);
+    if (hs.max_wait_us > bound_us)
+    {
+        printf("FAIL: max wait %llu us exceeds bound %llu us\n", (unsigned long long)hs.max_wait_us, (unsigned long long)bound_us);
+    }
+    else
+    {
+        printf("PASS: max wait within %llu us\n", (unsigned long long)bound_us);
+        ret = 0;
+    }
+err_close_dev:
+    tsl2561_topo_close(ent, num, mux, boot);
+err_stop_arb:
+    i2carb_destroy(arb);
+err_close_mux:
+    tca9458a_destroy(mux);
+    return ret;
+}
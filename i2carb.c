@@ -0,0 +1,311 @@
+/**
+ * @file i2carb.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Priority-aware arbiter for I2C devices sharing one bus
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include "i2carb.h"
+
+#define eprintf(str, ...) \
+    fprintf(stderr, "%s, %d: " str "\n", __func__, __LINE__, ##__VA_ARGS__); \
+    fflush(stderr)
+
+uint64_t i2carb_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Whether a should run before b: higher priority, then earlier
+ * deadline (no deadline sorts last), then earlier submission
+ *
+ */
+static int i2carb_before(const i2carb_req *a, const i2carb_req *b)
+{
+    if (a->cl->prio != b->cl->prio)
+        return a->cl->prio > b->cl->prio;
+    uint64_t da = a->deadline_us ? a->deadline_us : UINT64_MAX;
+    uint64_t db = b->deadline_us ? b->deadline_us : UINT64_MAX;
+    if (da != db)
+        return da < db;
+    return a->seq < b->seq;
+}
+
+static int i2carb_mergeable(const i2carb_req *a, const i2carb_req *b)
+{
+    return a->merge != NULL && a->merge == b->merge &&
+           a->dev == b->dev && a->chn == b->chn;
+}
+
+static void i2carb_unlink(i2carb *arb, i2carb_req *req)
+{
+    i2carb_req **p = &(arb->head);
+    while (*p != req)
+        p = &((*p)->next);
+    *p = req->next;
+    req->next = NULL;
+}
+
+/**
+ * @brief Remove the next transfer from the queue, along with any queued
+ * requests its merge rule accepts. Called with the lock held.
+ *
+ * @return int Number of requests in batch
+ */
+static int i2carb_dequeue(i2carb *arb, i2carb_req **batch, ssize_t *total)
+{
+    i2carb_req *best = arb->head;
+    for (i2carb_req *req = arb->head->next; req != NULL; req = req->next)
+    {
+        if (i2carb_before(req, best))
+            best = req;
+    }
+    i2carb_unlink(arb, best);
+    batch[0] = best;
+    *total = best->inlen;
+    int num = 1;
+    if (best->merge == NULL)
+        return num;
+    uint8_t out[I2CARB_MAX_MERGE];
+    ssize_t outlen = 0;
+    i2carb_req *req = arb->head;
+    while (req != NULL && num < I2CARB_MAX_MERGE)
+    {
+        i2carb_req *next = req->next;
+        if (i2carb_mergeable(best, req))
+        {
+            batch[num] = req;
+            ssize_t len = best->merge->pack(batch, num + 1, out, &outlen);
+            if (len >= 0 && len <= I2CARB_MAX_MERGE && outlen <= I2CARB_MAX_MERGE)
+            {
+                i2carb_unlink(arb, req);
+                *total += req->inlen;
+                num++;
+            }
+        }
+        req = next;
+    }
+    return num;
+}
+
+static int i2carb_run(i2carb *arb, i2carb_req **batch, int num)
+{
+    i2carb_req *req = batch[0];
+    if (arb->mux != NULL && req->chn >= 0 && req->chn != arb->cur_chn)
+    {
+        if (tca9458a_set(arb->mux, req->chn) < 0)
+        {
+            eprintf("Error: Could not set mux channel %d", req->chn);
+            arb->cur_chn = -1;
+            return -1;
+        }
+        arb->cur_chn = req->chn;
+    }
+    if (num == 1)
+    {
+        if (req->in == NULL)
+            return i2cbus_write(req->dev, req->out, req->outlen);
+        return i2cbus_xfer(req->dev, req->out, req->outlen, req->in, req->inlen, 0);
+    }
+    uint8_t out[I2CARB_MAX_MERGE];
+    uint8_t buf[I2CARB_MAX_MERGE];
+    ssize_t outlen = 0;
+    ssize_t len = req->merge->pack(batch, num, out, &outlen);
+    int status = i2cbus_xfer(req->dev, out, outlen, buf, len, 0);
+    if (status >= 0 && req->merge->unpack(batch, num, buf, len) < 0)
+    {
+        eprintf("Error: Malformed reply to merged transfer");
+        errno = EPROTO;
+        status = -1;
+    }
+    return status;
+}
+
+static void *i2carb_thread(void *arg)
+{
+    i2carb *arb = (i2carb *)arg;
+    i2carb_req *batch[I2CARB_MAX_MERGE];
+    pthread_mutex_lock(&arb->lock);
+    while (1)
+    {
+        while (arb->running && arb->head == NULL)
+            pthread_cond_wait(&arb->cond, &arb->lock);
+        if (arb->head == NULL) // stopped and drained
+            break;
+        ssize_t total = 0;
+        int num = i2carb_dequeue(arb, batch, &total);
+        pthread_mutex_unlock(&arb->lock);
+
+        uint64_t start = i2carb_now_us();
+        int status = i2carb_run(arb, batch, num);
+        int err = errno;
+        uint64_t end = i2carb_now_us();
+
+        pthread_mutex_lock(&arb->lock);
+        for (int i = 0; i < num; i++)
+        {
+            i2carb_req *req = batch[i];
+            i2carb_client *cl = req->cl;
+            uint64_t wait = start - req->submit_us;
+            // split bus time of a merged transfer by bytes read
+            cl->busy_us += (num == 1 || total == 0) ? (end - start) / num : (end - start) * req->inlen / total;
+            cl->wait_us += wait;
+            if (wait > cl->max_wait_us)
+                cl->max_wait_us = wait;
+            cl->xfers++;
+            if (num > 1)
+                cl->merged++;
+            if (status < 0)
+                cl->errors++;
+            if (req->deadline_us && end > req->deadline_us)
+                cl->missed++;
+            req->status = status;
+            req->err = err;
+            req->done = 1;
+        }
+        pthread_cond_broadcast(&arb->done_cond);
+    }
+    pthread_mutex_unlock(&arb->lock);
+    return NULL;
+}
+
+int i2carb_init(i2carb *arb, tca9458a *mux)
+{
+    pthread_mutex_init(&arb->lock, NULL);
+    pthread_cond_init(&arb->cond, NULL);
+    pthread_cond_init(&arb->done_cond, NULL);
+    arb->head = NULL;
+    arb->mux = mux;
+    arb->cur_chn = -1;
+    arb->seq = 0;
+    arb->running = 1;
+    if (pthread_create(&arb->thread, NULL, &i2carb_thread, arb) != 0)
+    {
+        eprintf("Error: Could not start arbiter thread");
+        arb->running = 0;
+        return -1;
+    }
+    return 1;
+}
+
+void i2carb_destroy(i2carb *arb)
+{
+    pthread_mutex_lock(&arb->lock);
+    if (!arb->running)
+    {
+        pthread_mutex_unlock(&arb->lock);
+        return;
+    }
+    arb->running = 0;
+    pthread_cond_signal(&arb->cond);
+    pthread_mutex_unlock(&arb->lock);
+    pthread_join(arb->thread, NULL);
+    pthread_cond_destroy(&arb->cond);
+    pthread_cond_destroy(&arb->done_cond);
+    pthread_mutex_destroy(&arb->lock);
+}
+
+void i2carb_client_init(i2carb_client *cl, i2carb *arb, int prio)
+{
+    memset(cl, 0, sizeof(i2carb_client));
+    cl->arb = arb;
+    cl->prio = prio;
+    cl->start_us = i2carb_now_us();
+}
+
+void i2carb_req_init(i2carb_req *req, i2cbus *dev, int chn, void *out, ssize_t outlen, void *in, ssize_t inlen, uint64_t deadline_us, const i2carb_merge_ops *merge)
+{
+    memset(req, 0, sizeof(i2carb_req));
+    req->dev = dev;
+    req->chn = chn;
+    req->out = (uint8_t *)out;
+    req->outlen = outlen;
+    req->in = (uint8_t *)in;
+    req->inlen = in == NULL ? 0 : inlen;
+    req->deadline_us = deadline_us;
+    req->merge = merge;
+}
+
+int i2carb_submit_n(i2carb_client *cl, i2carb_req *req, int num)
+{
+    i2carb *arb = cl->arb;
+    pthread_mutex_lock(&arb->lock);
+    if (!arb->running)
+    {
+        pthread_mutex_unlock(&arb->lock);
+        eprintf("Error: Arbiter is not running");
+        return -1;
+    }
+    uint64_t now = i2carb_now_us();
+    i2carb_req **p = &(arb->head);
+    while (*p != NULL)
+        p = &((*p)->next);
+    for (int i = 0; i < num; i++)
+    {
+        req[i].cl = cl;
+        req[i].seq = arb->seq++;
+        req[i].submit_us = now;
+        req[i].status = 0;
+        req[i].done = 0;
+        req[i].next = NULL;
+        *p = &(req[i]);
+        p = &(req[i].next);
+    }
+    pthread_cond_signal(&arb->cond);
+    pthread_mutex_unlock(&arb->lock);
+    return 1;
+}
+
+int i2carb_submit(i2carb_client *cl, i2carb_req *req)
+{
+    return i2carb_submit_n(cl, req, 1);
+}
+
+int i2carb_wait(i2carb_req *req)
+{
+    i2carb *arb = req->cl->arb;
+    pthread_mutex_lock(&arb->lock);
+    while (!req->done)
+        pthread_cond_wait(&arb->done_cond, &arb->lock);
+    pthread_mutex_unlock(&arb->lock);
+    if (req->status < 0)
+        errno = req->err;
+    return req->status;
+}
+
+int i2carb_xfer(i2carb_client *cl, i2cbus *dev, int chn, void *out, ssize_t outlen, void *in, ssize_t inlen, uint64_t deadline_us)
+{
+    i2carb_req req;
+    i2carb_req_init(&req, dev, chn, out, outlen, in, inlen, deadline_us, NULL);
+    if (i2carb_submit(cl, &req) < 0)
+        return -1;
+    return i2carb_wait(&req);
+}
+
+void i2carb_client_stats(i2carb_client *cl, i2carb_client *stats)
+{
+    pthread_mutex_lock(&cl->arb->lock);
+    memcpy(stats, cl, sizeof(i2carb_client));
+    pthread_mutex_unlock(&cl->arb->lock);
+}
+
+double i2carb_client_occupancy(i2carb_client *cl)
+{
+    i2carb_client stats;
+    i2carb_client_stats(cl, &stats);
+    uint64_t elapsed = i2carb_now_us() - stats.start_us;
+    if (elapsed == 0)
+        return 0.0;
+    return (double)stats.busy_us / elapsed;
+}
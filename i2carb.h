@@ -0,0 +1,223 @@
+/**
+ * @file i2carb.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Priority-aware arbiter for I2C devices sharing one bus
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+
+#ifndef I2CARB_H
+#define I2CARB_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <i2cbus/i2cbus.h>
+#include <tca9458a/tca9458a.h>
+
+#define I2CARB_MAX_MERGE (32)   ///< Maximum requests, command bytes and bytes read by one merged transfer
+
+#define I2CARB_PRIO_LOW (0)     ///< Background clients, e.g. lux sweeps
+#define I2CARB_PRIO_HIGH (100)  ///< Time-critical clients
+
+struct i2carb;
+struct i2carb_req;
+
+/**
+ * @brief Merge rule of a device. The arbiter only knows that requests with
+ * the same rule, device and channel may be merged, the rule decides how.
+ *
+ */
+typedef struct
+{
+    /**
+     * @brief Build the command of one transfer that serves all requests in
+     * batch, in any order.
+     *
+     * @return ssize_t Number of bytes to read, -1 if the batch cannot be merged
+     */
+    ssize_t (*pack)(struct i2carb_req *const *batch, int num, uint8_t *out, ssize_t *outlen);
+    /**
+     * @brief Check the reply of a merged transfer and copy each request's
+     * share into its in buffer.
+     *
+     * @return int 1 on success, -1 if the reply is malformed
+     */
+    int (*unpack)(struct i2carb_req *const *batch, int num, const uint8_t *buf, ssize_t len);
+} i2carb_merge_ops;
+
+/**
+ * @brief A client of the arbiter. Every transfer is accounted to the client
+ * that submitted it.
+ *
+ */
+typedef struct
+{
+    struct i2carb *arb;   ///< Arbiter the client belongs to
+    int prio;             ///< Priority of transfers submitted by this client, higher goes first
+    uint64_t start_us;    ///< Time at which the client was registered
+    uint64_t xfers;       ///< Transfers completed
+    uint64_t merged;      ///< Transfers completed as part of another transfer
+    uint64_t errors;      ///< Transfers that failed
+    uint64_t missed;      ///< Transfers completed after their deadline
+    uint64_t busy_us;     ///< Time the bus spent on this client's transfers, including mux switches
+    uint64_t wait_us;     ///< Total time transfers spent queued
+    uint64_t max_wait_us; ///< Longest time a transfer spent queued
+} i2carb_client;
+
+/**
+ * @brief A single transfer. Owned by the caller and must stay valid until
+ * i2carb_wait returns.
+ *
+ */
+typedef struct i2carb_req
+{
+    i2carb_client *cl;       ///< Submitting client
+    i2cbus *dev;             ///< Device handle
+    int chn;                 ///< Mux channel the device sits behind, -1 if not behind the mux
+    uint8_t *out;            ///< Bytes to write
+    ssize_t outlen;          ///< Number of bytes to write
+    uint8_t *in;             ///< Buffer for bytes read, NULL for a plain write
+    ssize_t inlen;           ///< Number of bytes to read
+    const i2carb_merge_ops *merge; ///< Merge rule of the device, NULL if the transfer is never merged
+    uint64_t deadline_us;    ///< Completion deadline on the i2carb_now_us() clock, 0 for none
+    uint64_t submit_us;      ///< Time of submission
+    uint64_t seq;            ///< Submission order
+    int status;              ///< Return status of the transfer
+    int err;                 ///< errno of a failed transfer
+    int done;                ///< Set when the transfer has completed
+    struct i2carb_req *next; ///< Queue link
+} i2carb_req;
+
+/**
+ * @brief Bus arbiter. A single worker thread owns the bus and the mux, and
+ * runs one queued transfer at a time: highest priority first, then earliest
+ * deadline, then submission order. Transfers are not preempted, so a queued
+ * transfer waits at most for the transfer in flight (one mux switch and at
+ * most I2CARB_MAX_MERGE bytes) plus the transfers queued ahead of it at the
+ * same or higher priority.
+ *
+ * Queued requests to the same device and channel that carry the same merge
+ * rule are run as one transfer when the rule accepts the batch.
+ *
+ * Once the arbiter is running, the mux must only be switched through it.
+ *
+ */
+typedef struct i2carb
+{
+    pthread_mutex_t lock;      ///< Protects the queue and client statistics
+    pthread_cond_t cond;       ///< Signalled when a transfer is queued
+    pthread_cond_t done_cond;  ///< Signalled when a transfer completes
+    pthread_t thread;          ///< Worker thread
+    i2carb_req *head;          ///< Queued transfers, in submission order
+    tca9458a *mux;             ///< Mux handle, NULL if no device is behind a mux
+    int cur_chn;               ///< Mux channel currently selected, -1 if unknown
+    uint64_t seq;              ///< Next submission number
+    int running;               ///< Cleared to stop the worker
+} i2carb;
+
+/**
+ * @brief Start an arbiter
+ *
+ * @param arb Arbiter handle
+ * @param mux Initialized mux handle, NULL if no device is behind a mux
+ * @return int 1 on success, -1 if the worker could not be started
+ */
+int i2carb_init(i2carb *arb, tca9458a *mux);
+/**
+ * @brief Run every queued transfer and stop the arbiter
+ *
+ * @param arb Arbiter handle
+ */
+void i2carb_destroy(i2carb *arb);
+/**
+ * @brief Register a client with the arbiter
+ *
+ * @param cl Client handle
+ * @param arb Arbiter handle
+ * @param prio Priority, I2CARB_PRIO_LOW to I2CARB_PRIO_HIGH
+ */
+void i2carb_client_init(i2carb_client *cl, i2carb *arb, int prio);
+/**
+ * @brief Fill in a transfer request
+ *
+ * @param req Request
+ * @param dev Device handle
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ * @param out Bytes to write
+ * @param outlen Number of bytes to write
+ * @param in Buffer for bytes read, NULL for a plain write
+ * @param inlen Number of bytes to read
+ * @param deadline_us Completion deadline on the i2carb_now_us() clock, 0 for none
+ * @param merge Merge rule of the device, NULL if the transfer is never merged
+ */
+void i2carb_req_init(i2carb_req *req, i2cbus *dev, int chn, void *out, ssize_t outlen, void *in, ssize_t inlen, uint64_t deadline_us, const i2carb_merge_ops *merge);
+/**
+ * @brief Queue a transfer without waiting for it
+ *
+ * @param cl Client handle
+ * @param req Request filled by i2carb_req_init
+ * @return int 1 on success, -1 if the arbiter is not running
+ */
+int i2carb_submit(i2carb_client *cl, i2carb_req *req);
+/**
+ * @brief Queue several transfers at once, so that mergeable reads are
+ * guaranteed to be seen together
+ *
+ * @param cl Client handle
+ * @param req Array of requests filled by i2carb_req_init
+ * @param num Number of requests
+ * @return int 1 on success, -1 if the arbiter is not running
+ */
+int i2carb_submit_n(i2carb_client *cl, i2carb_req *req, int num);
+/**
+ * @brief Wait for a queued transfer to complete
+ *
+ * @param req Request passed to i2carb_submit
+ * @return int Return status of i2cbus_xfer or i2cbus_write. On failure errno
+ * is set as the transfer left it in the arbiter thread.
+ */
+int i2carb_wait(i2carb_req *req);
+/**
+ * @brief Queue a transfer and wait for it to complete
+ *
+ * @param cl Client handle
+ * @param dev Device handle
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ * @param out Bytes to write
+ * @param outlen Number of bytes to write
+ * @param in Buffer for bytes read, NULL for a plain write
+ * @param inlen Number of bytes to read
+ * @param deadline_us Completion deadline on the i2carb_now_us() clock, 0 for none
+ * @return int Return status of i2cbus_xfer or i2cbus_write, -1 if the arbiter is not running
+ */
+int i2carb_xfer(i2carb_client *cl, i2cbus *dev, int chn, void *out, ssize_t outlen, void *in, ssize_t inlen, uint64_t deadline_us);
+/**
+ * @brief Consistent copy of a client's statistics
+ *
+ * @param cl Client handle
+ * @param stats Copy of the client handle
+ */
+void i2carb_client_stats(i2carb_client *cl, i2carb_client *stats);
+/**
+ * @brief Fraction of time since registration the bus spent on this client
+ *
+ * @param cl Client handle
+ * @return double Bus occupancy in [0, 1]
+ */
+double i2carb_client_occupancy(i2carb_client *cl);
+/**
+ * @brief Monotonic clock used for deadlines and statistics
+ *
+ * @return uint64_t Time in us
+ */
+uint64_t i2carb_now_us(void);
+#ifdef __cplusplus
+}
+#endif
+#endif // I2CARB_H
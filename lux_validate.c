@@ -0,0 +1,270 @@
+/**
+ * @file lux_validate.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Exhaustive validation of a candidate lux conversion kernel against
+ * tsl2561_get_lux_package() over the full 32-bit measurement domain, for both
+ * package coefficient sets
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "tsl2561.h"
+
+#define eprintf(str, ...) \
+    fprintf(stderr, "%s, %d: " str "\n", __func__, __LINE__, ##__VA_ARGS__); \
+    fflush(stderr)
+
+#define VALIDATE_CHUNK (1ULL << 16)        ///< Inputs a worker takes from its own range at a time
+#define VALIDATE_DOMAIN (1ULL << 32)       ///< Inputs per package
+#define VALIDATE_NUM_PKG (2)               ///< Number of package coefficient sets
+#define VALIDATE_MAX_REPORT (16)           ///< Mismatches reported
+#define VALIDATE_MAX_THREADS (256)         ///< Upper bound on worker threads
+
+/**
+ * @brief Candidate kernel: 32-bit arithmetic and table lookup with a
+ * branchless segment search instead of the if-else chain. All intermediate
+ * values fit in 32 bits because both channels are clipped at 4900 counts.
+ *
+ */
+static const uint16_t cand_k[VALIDATE_NUM_PKG][7] = {
+    {TSL2561_LUX_K1T, TSL2561_LUX_K2T, TSL2561_LUX_K3T, TSL2561_LUX_K4T, TSL2561_LUX_K5T, TSL2561_LUX_K6T, TSL2561_LUX_K7T},
+    {TSL2561_LUX_K1C, TSL2561_LUX_K2C, TSL2561_LUX_K3C, TSL2561_LUX_K4C, TSL2561_LUX_K5C, TSL2561_LUX_K6C, TSL2561_LUX_K7C},
+};
+static const uint16_t cand_b[VALIDATE_NUM_PKG][8] = {
+    {TSL2561_LUX_B1T, TSL2561_LUX_B2T, TSL2561_LUX_B3T, TSL2561_LUX_B4T, TSL2561_LUX_B5T, TSL2561_LUX_B6T, TSL2561_LUX_B7T, TSL2561_LUX_B8T},
+    {TSL2561_LUX_B1C, TSL2561_LUX_B2C, TSL2561_LUX_B3C, TSL2561_LUX_B4C, TSL2561_LUX_B5C, TSL2561_LUX_B6C, TSL2561_LUX_B7C, TSL2561_LUX_B8C},
+};
+static const uint16_t cand_m[VALIDATE_NUM_PKG][8] = {
+    {TSL2561_LUX_M1T, TSL2561_LUX_M2T, TSL2561_LUX_M3T, TSL2561_LUX_M4T, TSL2561_LUX_M5T, TSL2561_LUX_M6T, TSL2561_LUX_M7T, TSL2561_LUX_M8T},
+    {TSL2561_LUX_M1C, TSL2561_LUX_M2C, TSL2561_LUX_M3C, TSL2561_LUX_M4C, TSL2561_LUX_M5C, TSL2561_LUX_M6C, TSL2561_LUX_M7C, TSL2561_LUX_M8C},
+};
+
+static uint32_t candidate_lux(uint32_t measure, tsl2561Package_t package)
+{
+    uint32_t ch0 = measure >> 16, ch1 = measure & 0xffff;
+    if ((ch0 > TSL2561_CLIPPING_13MS) | (ch1 > TSL2561_CLIPPING_13MS))
+        return 65536;
+    const uint32_t chScale = TSL2561_LUX_CHSCALE_TINT0 << 4;
+    ch0 = (ch0 * chScale) >> TSL2561_LUX_CHSCALE;
+    ch1 = (ch1 * chScale) >> TSL2561_LUX_CHSCALE;
+    uint32_t ratio = ch0 ? (ch1 << (TSL2561_LUX_RATIOSCALE + 1)) / ch0 : 0;
+    ratio = (ratio + 1) >> 1;
+    const uint16_t *k = cand_k[package];
+    int seg = (ratio > k[0]) + (ratio > k[1]) + (ratio > k[2]) + (ratio > k[3]) +
+              (ratio > k[4]) + (ratio > k[5]) + (ratio > k[6]);
+    ch0 *= cand_b[package][seg];
+    ch1 *= cand_m[package][seg];
+    uint32_t temp = ch0 > ch1 ? ch0 - ch1 : 0;
+    return (temp + (1 << (TSL2561_LUX_LUXSCALE - 1))) >> TSL2561_LUX_LUXSCALE;
+}
+
+/**
+ * @brief Remaining range of one worker. The owner takes chunks from the
+ * bottom, idle workers steal the top half.
+ *
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint64_t lo;
+    uint64_t hi;
+} validate_range;
+
+typedef struct
+{
+    int id;
+    int nthreads;
+    validate_range *ranges;
+    uint64_t steals;
+    uint64_t checked;
+} validate_worker;
+
+typedef struct
+{
+    uint64_t input; // package << 32 | measure
+    uint32_t ref;
+    uint32_t cand;
+} validate_mismatch;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static validate_mismatch report[VALIDATE_MAX_REPORT];
+static int num_report = 0;
+static uint64_t num_mismatch[VALIDATE_NUM_PKG];
+
+static void record_mismatch(uint64_t input, uint32_t ref, uint32_t cand)
+{
+    pthread_mutex_lock(&report_lock);
+    num_mismatch[input >> 32]++;
+    // keep the lowest inputs, sorted
+    int pos = num_report;
+    while (pos > 0 && report[pos - 1].input > input)
+        pos--;
+    if (pos < VALIDATE_MAX_REPORT)
+    {
+        int last = num_report < VALIDATE_MAX_REPORT ? num_report : VALIDATE_MAX_REPORT - 1;
+        memmove(&report[pos + 1], &report[pos], (last - pos) * sizeof(validate_mismatch));
+        report[pos].input = input;
+        report[pos].ref = ref;
+        report[pos].cand = cand;
+        if (num_report < VALIDATE_MAX_REPORT)
+            num_report++;
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+static int take_chunk(validate_range *r, uint64_t *lo, uint64_t *hi)
+{
+    pthread_mutex_lock(&r->lock);
+    if (r->lo >= r->hi)
+    {
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+    *lo = r->lo;
+    *hi = r->hi - r->lo > VALIDATE_CHUNK ? r->lo + VALIDATE_CHUNK : r->hi;
+    r->lo = *hi;
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+}
+
+static int steal(validate_worker *w)
+{
+    validate_range *own = &(w->ranges[w->id]);
+    for (int i = 1; i < w->nthreads; i++)
+    {
+        validate_range *victim = &(w->ranges[(w->id + i) % w->nthreads]);
+        pthread_mutex_lock(&victim->lock);
+        uint64_t left = victim->hi > victim->lo ? victim->hi - victim->lo : 0;
+        if (left < 2 * VALIDATE_CHUNK)
+        {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        // split on a chunk boundary, so that chunks never straddle packages
+        uint64_t mid = (victim->lo + left / 2) & ~(VALIDATE_CHUNK - 1);
+        uint64_t hi = victim->hi;
+        victim->hi = mid;
+        pthread_mutex_unlock(&victim->lock);
+        pthread_mutex_lock(&own->lock);
+        own->lo = mid;
+        own->hi = hi;
+        pthread_mutex_unlock(&own->lock);
+        w->steals++;
+        return 1;
+    }
+    return 0;
+}
+
+static void *validate_thread(void *arg)
+{
+    validate_worker *w = (validate_worker *)arg;
+    uint64_t lo, hi;
+    while (1)
+    {
+        if (!take_chunk(&(w->ranges[w->id]), &lo, &hi))
+        {
+            if (!steal(w))
+                break;
+            continue;
+        }
+        // a chunk never straddles packages, the boundary is chunk aligned
+        tsl2561Package_t package = lo >> 32;
+        for (uint64_t in = lo; in < hi; in++)
+        {
+            uint32_t measure = in;
+            uint32_t ref = tsl2561_get_lux_package(measure, package);
+            uint32_t cand = candidate_lux(measure, package);
+            if (ref != cand)
+                record_mismatch(in, ref, cand);
+        }
+        w->checked += hi - lo;
+    }
+    return NULL;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 2)
+    {
+        printf("Invocation: ./%s [Number of threads]\n\n", argv[0]);
+        return 0;
+    }
+    if (argc == 2)
+        nthreads = atoi(argv[1]);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > VALIDATE_MAX_THREADS)
+        nthreads = VALIDATE_MAX_THREADS;
+
+    const uint64_t total = VALIDATE_DOMAIN * VALIDATE_NUM_PKG;
+    validate_range ranges[nthreads];
+    validate_worker workers[nthreads];
+    pthread_t threads[nthreads];
+    // initial static partition on chunk boundaries, stealing evens out the rest
+    uint64_t nchunks = total / VALIDATE_CHUNK;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&ranges[i].lock, NULL);
+        ranges[i].lo = (nchunks * i / nthreads) * VALIDATE_CHUNK;
+        ranges[i].hi = (nchunks * (i + 1) / nthreads) * VALIDATE_CHUNK;
+        workers[i].id = i;
+        workers[i].nthreads = nthreads;
+        workers[i].ranges = ranges;
+        workers[i].steals = 0;
+        workers[i].checked = 0;
+    }
+    printf("Sweeping %llu inputs (%d packages) on %d threads...\n", (unsigned long long)total, VALIDATE_NUM_PKG, nthreads);
+    fflush(stdout);
+    double s = now_s();
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, &validate_thread, &workers[i]) != 0)
+        {
+            eprintf("Error: Could not create thread %d", i);
+            return -1;
+        }
+    }
+    uint64_t checked = 0, steals = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        checked += workers[i].checked;
+        steals += workers[i].steals;
+    }
+    double e = now_s();
+
+    for (int i = 0; i < num_report; i++)
+    {
+        uint32_t measure = report[i].input;
+        printf("Mismatch: %s measure 0x%08x (CH0 %u CH1 %u): reference %u candidate %u\n",
+               (report[i].input >> 32) == TSL2561_PKG_CS ? "CS" : "T/FN/CL",
+               measure, measure >> 16, measure & 0xffff, report[i].ref, report[i].cand);
+    }
+    printf("T/FN/CL: %llu mismatches | CS: %llu mismatches\n",
+           (unsigned long long)num_mismatch[TSL2561_PKG_T_FN_CL], (unsigned long long)num_mismatch[TSL2561_PKG_CS]);
+    printf("Checked %llu inputs in %.2f s: %.1f M inputs/s, %llu steals\n",
+           (unsigned long long)checked, e - s, checked / (e - s) * 1e-6, (unsigned long long)steals);
+    if (checked != total)
+    {
+        eprintf("Error: Checked %llu of %llu inputs", (unsigned long long)checked, (unsigned long long)total);
+        return -1;
+    }
+    return (num_mismatch[TSL2561_PKG_T_FN_CL] || num_mismatch[TSL2561_PKG_CS]) ? 1 : 0;
+}
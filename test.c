@@ -1,4 +1,6 @@
 #include "tsl2561.h"
+#include "tsl2561_sched.h"
+#include "tsl2561_topo.h"
 #include "tca9458a/tca9458a.h"
 #include <stdio.h>
 #include <signal.h>
@@ -15,142 +17,112 @@ void sighandler(int sig)
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    if (argc < 2 || argc > 5)
     {
-        printf("Invocation: sudo ./testcss.out <I2C Bus Number>\n\n");
+        printf("Invocation: sudo ./testcss.out <I2C Bus Number> [duty] [hdr] [rescan]\n\n");
         return 0;
     }
+    int duty = 0, hdr_mode = 0, rescan = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        duty |= strcmp(argv[i], "duty") == 0;
+        hdr_mode |= strcmp(argv[i], "hdr") == 0;
+        rescan |= strcmp(argv[i], "rescan") == 0;
+    }
     int bus = atoi(argv[1]);
     signal(SIGINT, &sighandler);
-    tsl2561 lux[7];
+    tsl2561 lux[TSL2561_TOPO_MAX];
+    tsl2561_sched_dev ent[TSL2561_TOPO_MAX];
+    tsl2561_hdr hdr[TSL2561_TOPO_MAX];
+    tsl2561_topo topo[1];
     tca9458a mux[1];
     if (tca9458a_init(mux, bus, 0x70, 0) < 0)
     {
         printf("Could not initialize mux\n");
         return 0;
     }
-    // activate mux channel 0
-    if (tca9458a_set(mux, 0) < 0)
+    // all bus traffic, including mux switches, goes through the arbiter
+    i2carb arb[1];
+    i2carb_client cl[1];
+    if (i2carb_init(arb, mux) < 0)
     {
-        printf("Could not set mux channel 0\n");
+        printf("Could not start bus arbiter\n");
         goto err_close_mux;
     }
-    // activate dev on channel 0
-    if (tsl2561_init(&(lux[0]), bus, 0x29, 0) < 0)
-    {
-        printf("Could not open 0x29 chn 0\n");
-    }
-    if (tsl2561_init(&(lux[1]), bus, 0x39, 0) < 0)
-    {
-        printf("Could not open 0x39 chn 0\n");
-    }
-    if (tsl2561_init(&(lux[2]), bus, 0x49, 0) < 0)
+    i2carb_client_init(cl, arb, I2CARB_PRIO_LOW);
+    // load the cached bus map, or scan all mux channels if it is stale or a
+    // rescan was requested (the cache does not pick up added sensors)
+    int cached = tsl2561_topo_discover(topo, mux, cl, bus, 0x70, TSL2561_TOPO_CACHE, rescan);
+    if (cached < 0)
     {
-        printf("Could not open 0x49 chn 0\n");
+        printf("Could not discover devices\n");
+        goto err_stop_arb;
     }
-    // activate mux channel 1
-    if (tca9458a_set(mux, 1) < 0)
+    printf("%s: %d devices\n", cached ? "Cached topology" : "Scanned topology", topo->num);
+    for (int i = 0; i < topo->num; i++)
     {
-        printf("Could not set mux channel 0\n");
-        goto err_close_mux;
-    }
-    // activate dev on channel 1
-    if (tsl2561_init(&(lux[3]), bus, 0x39, 0) < 0)
-    {
-        printf("Could not open 0x39 chn 0\n");
+        if (topo->ent[i].chn == TSL2561_TOPO_NOMUX)
+            printf("  0x%02x no mux\n", topo->ent[i].addr);
+        else
+            printf("  0x%02x chn %d\n", topo->ent[i].addr, topo->ent[i].chn);
     }
-    if (tsl2561_init(&(lux[4]), bus, 0x49, 0) < 0)
+    // activate devs, ordered by mux channel
+    int num = tsl2561_topo_open(topo, mux, cl, lux, ent);
+    if (num <= 0)
     {
-        printf("Could not open 0x49 chn 0\n");
+        printf("Could not open any device\n");
+        goto err_stop_arb;
     }
-    if (tsl2561_init(&(lux[5]), bus, 0x29, 0) < 0)
+    tsl2561_sched sched[1];
+    if (tsl2561_sched_init(sched, ent, num, mux, TSL2561_SCHED_MIN_PERIOD_MS, TSL2561_SCHED_MAX_PERIOD_MS) < 0)
     {
-        printf("Could not open 0x29 chn 0\n");
+        printf("Could not initialize scheduler\n");
+        goto err_close_dev;
     }
-    // activate mux channel 1
-    if (tca9458a_set(mux, 2) < 0)
+    tsl2561_sched_set_arbiter(sched, cl);
+#ifdef CSS_LOW_GAIN
+    tsl2561IntegrationTime_t inttime = TSL2561_INTEGRATIONTIME_13MS; // set by tsl2561_init
+#else
+    tsl2561IntegrationTime_t inttime = TSL2561_INTEGRATIONTIME_402MS; // power up default
+#endif
+    if (duty && tsl2561_sched_set_duty_cycle(sched, 1, inttime) < 0)
     {
-        printf("Could not set mux channel 0\n");
-        goto err_close_mux;
+        printf("Could not enable duty cycled mode\n");
     }
-    if (tsl2561_init(&(lux[6]), bus, 0x39, 0) < 0)
+    // alternate short and long exposures, one merged lux stream per device
+    if (hdr_mode && tsl2561_sched_set_hdr(sched, hdr, NULL, NULL) < 0)
     {
-        printf("Could not open 0x39 chn 0\n");
+        printf("Could not enable HDR mode\n");
     }
     ssize_t print_char = 0;
     while (!done)
     {
-        uint32_t lv[7];
-        uint32_t mes;
-        // activate mux channel 0
-        if (tca9458a_set(mux, 0) < 0)
-        {
-            printf("Could not set mux channel 0\n");
-            goto err_close_mux;
-        }
-        // read dev on chn 0
-        tsl2561_measure(&(lux[0]), &mes);
-        lv[0] = tsl2561_get_lux(mes);
-        tsl2561_measure(&(lux[1]), &mes);
-        lv[1] = tsl2561_get_lux(mes);
-        tsl2561_measure(&(lux[2]), &mes);
-        lv[2] = tsl2561_get_lux(mes);
-        // activate mux channel 1
-        if (tca9458a_set(mux, 1) < 0)
+        uint64_t now = tsl2561_sched_now_ms();
+        if (tsl2561_sched_poll(sched, now) < 0)
         {
-            printf("Could not set mux channel 0\n");
-            goto err_close_mux;
+            printf("Could not read devices\n");
+            goto err_close_dev;
         }
-        tsl2561_measure(&(lux[3]), &mes);
-        lv[3] = tsl2561_get_lux(mes);
-        tsl2561_measure(&(lux[4]), &mes);
-        lv[4] = tsl2561_get_lux(mes);
-        tsl2561_measure(&(lux[5]), &mes);
-        lv[5] = tsl2561_get_lux(mes);
-        // activate mux channel 0
-        if (tca9458a_set(mux, 2) < 0)
-        {
-            printf("Could not set mux channel 0\n");
-            goto err_close_mux;
-        }
-        tsl2561_measure(&(lux[6]), &mes);
-        lv[6] = tsl2561_get_lux(mes);
-        print_char = printf("%u %u %u %u %u %u %u\r", lv[0], lv[1], lv[2], lv[3], lv[4], lv[5], lv[6]);
+        print_char = 0;
+        for (int i = 0; i < num; i++)
+            print_char += printf("%u%s ", ent[i].lux, (ent[i].hdr != NULL && ent[i].hdr->sat) ? "+" : "");
+        print_char += printf("| Duty: %.3f | Samples/xfer: %.3f | Bus: %.3f\r", tsl2561_sched_duty(sched), tsl2561_sched_samples_per_xfer(sched), i2carb_client_occupancy(cl));
         fflush(stdout);
-        usleep(100*1000);
+        // sleep until the next device is due
+        uint64_t next = tsl2561_sched_next(sched);
+        now = tsl2561_sched_now_ms();
+        if (next > now)
+            usleep((next - now) * 1000);
         while(print_char--)
             printf(" ");
         printf("\r");
     }
     printf("\n");
-    // activate mux channel 0
-    if (tca9458a_set(mux, 0) < 0)
-    {
-        printf("Could not set mux channel 0\n");
-        goto err_close_mux;
-    }
-    // printf("Here\n");
-    // fflush(stdout);
+err_close_dev:
     // destroy
-    tsl2561_destroy(&(lux[0]));
-    tsl2561_destroy(&(lux[1]));
-    tsl2561_destroy(&(lux[2]));
-    // activate mux channel 1
-    if (tca9458a_set(mux, 1) < 0)
-    {
-        printf("Could not set mux channel 0\n");
-        goto err_close_mux;
-    }
-    tsl2561_destroy(&(lux[3]));
-    tsl2561_destroy(&(lux[4]));
-    tsl2561_destroy(&(lux[5]));
-    // activate mux channel 2
-    if (tca9458a_set(mux, 2) < 0)
-    {
-        printf("Could not set mux channel 0\n");
-        goto err_close_mux;
-    }
-    tsl2561_destroy(&(lux[6]));
+    tsl2561_topo_close(ent, num, mux, cl);
+err_stop_arb:
+    i2carb_destroy(arb);
 err_close_mux:
     tca9458a_destroy(mux);
     return 0;
@@ -21,30 +21,37 @@
     fprintf(stderr, "%s, %d: " str "\n", __func__, __LINE__, ##__VA_ARGS__); \
     fflush(stderr)
 
-int tsl2561_init(tsl2561 *dev, int id, int addr, int ctx)
+/**
+ * @brief Issue a transfer directly, or through a bus arbiter if cl is set
+ * 
+ * @return int Return status of i2cbus_write or i2cbus_xfer
+ */
+static int tsl2561_xfer(tsl2561 *dev, i2carb_client *cl, int chn, void *out, ssize_t outlen, void *in, ssize_t inlen)
 {
-    // Create the file descriptor handle to the device
-    if (i2cbus_open(dev, id, addr) < 0)
-    {
-        eprintf("Error: Failed to open I2C Bus");
-        return -1;
-    }
+    if (cl != NULL)
+        return i2carb_xfer(cl, dev, chn, out, outlen, in, inlen, 0);
+    if (in == NULL)
+        return i2cbus_write(dev, out, outlen);
+    return i2cbus_xfer(dev, out, outlen, in, inlen, 0);
+}
 
+static int tsl2561_setup(tsl2561 *dev, i2carb_client *cl, int chn)
+{
     // Power the device - write to control register
     unsigned char cmd_pwup[] = {0x80, 0x03};
-    if (i2cbus_write(dev, cmd_pwup, sizeof(cmd_pwup)) < 0)
+    if (tsl2561_xfer(dev, cl, chn, cmd_pwup, sizeof(cmd_pwup), NULL, 0) < 0)
     {
         eprintf("Error: Failed to send power up command");
         return -1;
     }
     usleep(100000);
     // Verify that device is powered
-    if (i2cbus_xfer(dev, cmd_pwup, 1, cmd_pwup + 1, 1, 0) < 0)
+    if (tsl2561_xfer(dev, cl, chn, cmd_pwup, 1, cmd_pwup + 1, 1) < 0)
     {
         eprintf("Error: Could not read the power up register");
         return -1;
     }
-    if ((cmd_pwup[1] & 0x3) != 0x3)
+    if ((cmd_pwup[1] & TSL2561_CONTROL_POWER_MASK) != TSL2561_CONTROL_POWERON)
     {
         eprintf("Power up failed, returned 0x%02x", cmd_pwup[1]);
         return -1;
@@ -53,13 +60,13 @@ int tsl2561_init(tsl2561 *dev, int id, int addr, int ctx)
 #ifdef CSS_LOW_GAIN
     // Set the timing and gain
     unsigned char cmd_gain[] = {0x81, 0x0};
-    if (i2cbus_write(dev, cmd_gain, sizeof(cmd_gain)) < 0)
+    if (tsl2561_xfer(dev, cl, chn, cmd_gain, sizeof(cmd_gain), NULL, 0) < 0)
     {
         eprintf("Error: Failed to send gain command");
         return -1;
     }
     usleep(100000);
-    if (i2cbus_xfer(dev, cmd_gain, 1, cmd_gain + 1, 1, 0) < 0)
+    if (tsl2561_xfer(dev, cl, chn, cmd_gain, 1, cmd_gain + 1, 1) < 0)
     {
         eprintf("Error: Could not read the gain register");
         return -1;
@@ -73,6 +80,40 @@ int tsl2561_init(tsl2561 *dev, int id, int addr, int ctx)
     return 1;
 }
 
+int tsl2561_init(tsl2561 *dev, int id, int addr, int ctx)
+{
+    // Create the file descriptor handle to the device
+    if (i2cbus_open(dev, id, addr) < 0)
+    {
+        eprintf("Error: Failed to open I2C Bus");
+        return -1;
+    }
+    if (tsl2561_setup(dev, NULL, -1) < 0)
+        goto close;
+    return 1;
+close:
+    // setup may have failed after the power up command went through
+    tsl2561_power(dev, 0);
+    i2cbus_close(dev);
+    return -1;
+}
+
+int tsl2561_init_arb(tsl2561 *dev, i2carb_client *cl, int chn, int id, int addr, int ctx)
+{
+    if (i2cbus_open(dev, id, addr) < 0)
+    {
+        eprintf("Error: Failed to open I2C Bus");
+        return -1;
+    }
+    if (tsl2561_setup(dev, cl, chn) < 0)
+        goto close;
+    return 1;
+close:
+    tsl2561_power_arb(dev, cl, chn, 0);
+    i2cbus_close(dev);
+    return -1;
+}
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -108,13 +149,198 @@ int tsl2561_measure(tsl2561 *dev, uint32_t *measure)
     return 1;
 }
 
+#ifdef TSL2561_BLOCK_MERGE
+/**
+ * @brief Offset of a word read of CH0 or CH1 within the four ADC data registers
+ * 
+ * @return int Word offset, -1 if req is not such a read
+ */
+static int tsl2561_block_ofst(const i2carb_req *req)
+{
+    if (req->outlen != 1 || req->inlen != 2)
+        return -1;
+    if (req->out[0] == (TSL2561_COMMAND_BIT | TSL2561_WORD_BIT | TSL2561_REGISTER_CHAN0_LOW))
+        return 0;
+    if (req->out[0] == (TSL2561_COMMAND_BIT | TSL2561_WORD_BIT | TSL2561_REGISTER_CHAN1_LOW))
+        return 1;
+    return -1;
+}
+
+/**
+ * @brief Merge word reads of CH0 and CH1 into one I2C block read. With the
+ * block bit set, a read starting at DATA0LOW returns DATA0LOW, DATA0HIGH,
+ * DATA1LOW and DATA1HIGH. Unlike the SMBus block read of the TSL2560, the I2C
+ * part sends no byte count.
+ * 
+ */
+static ssize_t tsl2561_block_pack(i2carb_req *const *batch, int num, uint8_t *out, ssize_t *outlen)
+{
+    uint8_t seen = 0;
+    for (int i = 0; i < num; i++)
+    {
+        int ofst = tsl2561_block_ofst(batch[i]);
+        if (ofst < 0 || (seen & (1 << ofst)))
+            return -1;
+        seen |= 1 << ofst;
+    }
+    out[0] = TSL2561_COMMAND_BIT | TSL2561_BLOCK_BIT | TSL2561_REGISTER_CHAN0_LOW;
+    *outlen = 1;
+    return 4;
+}
+
+static int tsl2561_block_unpack(i2carb_req *const *batch, int num, const uint8_t *buf, ssize_t len)
+{
+    if (len != 4)
+        return -1;
+    for (int i = 0; i < num; i++)
+        memcpy(batch[i]->in, buf + 2 * tsl2561_block_ofst(batch[i]), 2);
+    return 1;
+}
+
+static const i2carb_merge_ops tsl2561_block_ops = {&tsl2561_block_pack, &tsl2561_block_unpack};
+#define TSL2561_MERGE_OPS (&tsl2561_block_ops)
+#else
+#define TSL2561_MERGE_OPS (NULL) // two word reads
+#endif
+
+int tsl2561_measure_arb(tsl2561 *dev, i2carb_client *cl, int chn, uint64_t deadline_us, uint32_t *measure)
+{
+    if (unlikely(dev == NULL || cl == NULL))
+    {
+        return -1;
+    }
+    *measure = 0x0;
+    // word reads of CH0 and CH1, queued together so that the arbiter runs
+    // them back to back, merged into one block read with TSL2561_BLOCK_MERGE
+    uint8_t cmd[] = {TSL2561_COMMAND_BIT | TSL2561_WORD_BIT | TSL2561_REGISTER_CHAN0_LOW,
+                     TSL2561_COMMAND_BIT | TSL2561_WORD_BIT | TSL2561_REGISTER_CHAN1_LOW};
+    uint8_t buf[4] = {0x0, };
+    i2carb_req req[2];
+    i2carb_req_init(&req[0], dev, chn, &cmd[0], 1, &buf[0], 2, deadline_us, TSL2561_MERGE_OPS);
+    i2carb_req_init(&req[1], dev, chn, &cmd[1], 1, &buf[2], 2, deadline_us, TSL2561_MERGE_OPS);
+    if (unlikely(i2carb_submit_n(cl, req, 2) < 0))
+    {
+        eprintf("Error: Could not queue measurement");
+        return -1;
+    }
+    int status0 = i2carb_wait(&req[0]);
+    int status1 = i2carb_wait(&req[1]);
+    if (unlikely(status0 < 0 || status1 < 0))
+    {
+        eprintf("Error reading channel data");
+        return -1;
+    }
+    *measure = (buf[1] << 8 | buf[0]) << 16 | (buf[3] << 8 | buf[2]);
+    return 1;
+}
+
 /**
- * @brief Calculate lux using value measured using tsl2561_measure()
+ * @brief Select the lux formula coefficients for a channel ratio
+ * 
+ * @param ratio CH1/CH0 scaled by 2^TSL2561_LUX_RATIOSCALE
+ * @param package Package coefficient set
+ * @param b CH0 coefficient
+ * @param m CH1 coefficient
+ */
+static inline void tsl2561_lux_coeff(unsigned long ratio, tsl2561Package_t package, unsigned int *b, unsigned int *m)
+{
+    if (package == TSL2561_PKG_CS)
+    {
+        if ((ratio >= 0) && (ratio <= TSL2561_LUX_K1C))
+        {
+            *b = TSL2561_LUX_B1C;
+            *m = TSL2561_LUX_M1C;
+        }
+        else if (ratio <= TSL2561_LUX_K2C)
+        {
+            *b = TSL2561_LUX_B2C;
+            *m = TSL2561_LUX_M2C;
+        }
+        else if (ratio <= TSL2561_LUX_K3C)
+        {
+            *b = TSL2561_LUX_B3C;
+            *m = TSL2561_LUX_M3C;
+        }
+        else if (ratio <= TSL2561_LUX_K4C)
+        {
+            *b = TSL2561_LUX_B4C;
+            *m = TSL2561_LUX_M4C;
+        }
+        else if (ratio <= TSL2561_LUX_K5C)
+        {
+            *b = TSL2561_LUX_B5C;
+            *m = TSL2561_LUX_M5C;
+        }
+        else if (ratio <= TSL2561_LUX_K6C)
+        {
+            *b = TSL2561_LUX_B6C;
+            *m = TSL2561_LUX_M6C;
+        }
+        else if (ratio <= TSL2561_LUX_K7C)
+        {
+            *b = TSL2561_LUX_B7C;
+            *m = TSL2561_LUX_M7C;
+        }
+        else if (ratio > TSL2561_LUX_K8C)
+        {
+            *b = TSL2561_LUX_B8C;
+            *m = TSL2561_LUX_M8C;
+        }
+    }
+    else
+    {
+        if ((ratio >= 0) && (ratio <= TSL2561_LUX_K1T))
+        {
+            *b = TSL2561_LUX_B1T;
+            *m = TSL2561_LUX_M1T;
+        }
+        else if (ratio <= TSL2561_LUX_K2T)
+        {
+            *b = TSL2561_LUX_B2T;
+            *m = TSL2561_LUX_M2T;
+        }
+        else if (ratio <= TSL2561_LUX_K3T)
+        {
+            *b = TSL2561_LUX_B3T;
+            *m = TSL2561_LUX_M3T;
+        }
+        else if (ratio <= TSL2561_LUX_K4T)
+        {
+            *b = TSL2561_LUX_B4T;
+            *m = TSL2561_LUX_M4T;
+        }
+        else if (ratio <= TSL2561_LUX_K5T)
+        {
+            *b = TSL2561_LUX_B5T;
+            *m = TSL2561_LUX_M5T;
+        }
+        else if (ratio <= TSL2561_LUX_K6T)
+        {
+            *b = TSL2561_LUX_B6T;
+            *m = TSL2561_LUX_M6T;
+        }
+        else if (ratio <= TSL2561_LUX_K7T)
+        {
+            *b = TSL2561_LUX_B7T;
+            *m = TSL2561_LUX_M7T;
+        }
+        else if (ratio > TSL2561_LUX_K8T)
+        {
+            *b = TSL2561_LUX_B8T;
+            *m = TSL2561_LUX_M8T;
+        }
+    }
+}
+
+/**
+ * @brief Calculate lux using value measured using tsl2561_measure(), with the
+ * coefficients of the given package
  * 
  * @param measure 
+ * @param package Package coefficient set
  * @return Lux value 
  */
-uint32_t tsl2561_get_lux(uint32_t measure)
+uint32_t tsl2561_get_lux_package(uint32_t measure, tsl2561Package_t package)
 {
     unsigned long chScale;
     unsigned long channel1;
@@ -152,90 +378,7 @@ uint32_t tsl2561_get_lux(uint32_t measure)
     unsigned long ratio = (ratio1 + 1) >> 1;
 
     unsigned int b, m;
-
-#ifdef TSL2561_PACKAGE_CS
-    if ((ratio >= 0) && (ratio <= TSL2561_LUX_K1C))
-    {
-        b = TSL2561_LUX_B1C;
-        m = TSL2561_LUX_M1C;
-    }
-    else if (ratio <= TSL2561_LUX_K2C)
-    {
-        b = TSL2561_LUX_B2C;
-        m = TSL2561_LUX_M2C;
-    }
-    else if (ratio <= TSL2561_LUX_K3C)
-    {
-        b = TSL2561_LUX_B3C;
-        m = TSL2561_LUX_M3C;
-    }
-    else if (ratio <= TSL2561_LUX_K4C)
-    {
-        b = TSL2561_LUX_B4C;
-        m = TSL2561_LUX_M4C;
-    }
-    else if (ratio <= TSL2561_LUX_K5C)
-    {
-        b = TSL2561_LUX_B5C;
-        m = TSL2561_LUX_M5C;
-    }
-    else if (ratio <= TSL2561_LUX_K6C)
-    {
-        b = TSL2561_LUX_B6C;
-        m = TSL2561_LUX_M6C;
-    }
-    else if (ratio <= TSL2561_LUX_K7C)
-    {
-        b = TSL2561_LUX_B7C;
-        m = TSL2561_LUX_M7C;
-    }
-    else if (ratio > TSL2561_LUX_K8C)
-    {
-        b = TSL2561_LUX_B8C;
-        m = TSL2561_LUX_M8C;
-    }
-#else
-    if ((ratio >= 0) && (ratio <= TSL2561_LUX_K1T))
-    {
-        b = TSL2561_LUX_B1T;
-        m = TSL2561_LUX_M1T;
-    }
-    else if (ratio <= TSL2561_LUX_K2T)
-    {
-        b = TSL2561_LUX_B2T;
-        m = TSL2561_LUX_M2T;
-    }
-    else if (ratio <= TSL2561_LUX_K3T)
-    {
-        b = TSL2561_LUX_B3T;
-        m = TSL2561_LUX_M3T;
-    }
-    else if (ratio <= TSL2561_LUX_K4T)
-    {
-        b = TSL2561_LUX_B4T;
-        m = TSL2561_LUX_M4T;
-    }
-    else if (ratio <= TSL2561_LUX_K5T)
-    {
-        b = TSL2561_LUX_B5T;
-        m = TSL2561_LUX_M5T;
-    }
-    else if (ratio <= TSL2561_LUX_K6T)
-    {
-        b = TSL2561_LUX_B6T;
-        m = TSL2561_LUX_M6T;
-    }
-    else if (ratio <= TSL2561_LUX_K7T)
-    {
-        b = TSL2561_LUX_B7T;
-        m = TSL2561_LUX_M7T;
-    }
-    else if (ratio > TSL2561_LUX_K8T)
-    {
-        b = TSL2561_LUX_B8T;
-        m = TSL2561_LUX_M8T;
-    }
-#endif
+    tsl2561_lux_coeff(ratio, package, &b, &m);
 
     unsigned long temp;
     channel0 = channel0 * b;
@@ -256,6 +399,223 @@ uint32_t tsl2561_get_lux(uint32_t measure)
     return lux;
 }
 
+uint32_t tsl2561_get_lux(uint32_t measure)
+{
+    return tsl2561_get_lux_package(measure, TSL2561_PKG_DEFAULT);
+}
+
+int tsl2561_write_timing(tsl2561 *dev, tsl2561Gain_t gain, tsl2561IntegrationTime_t inttime)
+{
+    return tsl2561_write_timing_arb(dev, NULL, -1, gain, inttime);
+}
+
+int tsl2561_write_timing_arb(tsl2561 *dev, i2carb_client *cl, int chn, tsl2561Gain_t gain, tsl2561IntegrationTime_t inttime)
+{
+    unsigned char cmd_buf[] = {TSL2561_COMMAND_BIT | TSL2561_REGISTER_TIMING, gain | inttime};
+    if (unlikely(tsl2561_xfer(dev, cl, chn, cmd_buf, 2, NULL, 0) != 2))
+    {
+        eprintf("Error: Failed to send timing command");
+        return -1;
+    }
+    return 1;
+}
+
+int tsl2561_set_timing(tsl2561 *dev, tsl2561Gain_t gain, tsl2561IntegrationTime_t inttime)
+{
+    // Power cycle around the write so that the integration in progress is
+    // discarded and the next one starts with the new setting
+    if (tsl2561_power(dev, 0) < 0)
+        return -1;
+    if (tsl2561_write_timing(dev, gain, inttime) < 0)
+        return -1;
+    return tsl2561_power(dev, 1);
+}
+
+/**
+ * @brief Scale that brings counts at the given exposure to 402ms/16x counts,
+ * in units of 2^-TSL2561_LUX_CHSCALE
+ */
+static inline uint32_t tsl2561_exposure_scale(const tsl2561_exposure *exp)
+{
+    uint32_t chScale;
+    switch (exp->inttime)
+    {
+    case TSL2561_INTEGRATIONTIME_13MS:
+        chScale = TSL2561_LUX_CHSCALE_TINT0;
+        break;
+    case TSL2561_INTEGRATIONTIME_101MS:
+        chScale = TSL2561_LUX_CHSCALE_TINT1;
+        break;
+    default:
+        chScale = (1 << TSL2561_LUX_CHSCALE);
+        break;
+    }
+    if (exp->gain == TSL2561_GAIN_1X)
+        chScale = chScale << 4;
+    return chScale;
+}
+
+static inline uint16_t tsl2561_exposure_clip(const tsl2561_exposure *exp)
+{
+    switch (exp->inttime)
+    {
+    case TSL2561_INTEGRATIONTIME_13MS:
+        return TSL2561_CLIPPING_13MS;
+    case TSL2561_INTEGRATIONTIME_101MS:
+        return TSL2561_CLIPPING_101MS;
+    default:
+        return TSL2561_CLIPPING_402MS;
+    }
+}
+
+void tsl2561_hdr_reset(tsl2561_hdr *hdr, const tsl2561_exposure *exp_short, const tsl2561_exposure *exp_long)
+{
+    static const tsl2561_exposure def_short = {TSL2561_GAIN_1X, TSL2561_INTEGRATIONTIME_13MS};
+    static const tsl2561_exposure def_long = {TSL2561_GAIN_16X, TSL2561_INTEGRATIONTIME_13MS};
+    memset(hdr, 0, sizeof(tsl2561_hdr));
+    hdr->exp[0] = exp_short == NULL ? def_short : *exp_short;
+    hdr->exp[1] = exp_long == NULL ? def_long : *exp_long;
+    hdr->cur = 0;
+}
+
+int tsl2561_hdr_init(tsl2561 *dev, tsl2561_hdr *hdr, const tsl2561_exposure *exp_short, const tsl2561_exposure *exp_long)
+{
+    tsl2561_hdr_reset(hdr, exp_short, exp_long);
+    return tsl2561_set_timing(dev, hdr->exp[0].gain, hdr->exp[0].inttime);
+}
+
+uint32_t tsl2561_hdr_delay_ms(const tsl2561_hdr *hdr)
+{
+    switch (hdr->exp[hdr->cur].inttime)
+    {
+    case TSL2561_INTEGRATIONTIME_13MS:
+        return TSL2561_DELAY_INTTIME_13MS;
+    case TSL2561_INTEGRATIONTIME_101MS:
+        return TSL2561_DELAY_INTTIME_101MS;
+    default:
+        return TSL2561_DELAY_INTTIME_402MS;
+    }
+}
+
+uint32_t tsl2561_hdr_lux(tsl2561_hdr *hdr)
+{
+    uint64_t channel[2];
+    hdr->sat = 0;
+    if (!hdr->valid)
+        return 0;
+    for (int ch = 0; ch < 2; ch++)
+    {
+        // CH0 is the upper half of the measurement
+        uint16_t count_short = hdr->measure[0] >> (ch ? 0 : 16);
+        uint16_t count_long = hdr->measure[1] >> (ch ? 0 : 16);
+        /* Take the long exposure unless it is clipped */
+        if ((hdr->valid & 0x2) && (count_long <= tsl2561_exposure_clip(&(hdr->exp[1]))))
+        {
+            channel[ch] = ((uint64_t)count_long * tsl2561_exposure_scale(&(hdr->exp[1]))) >> TSL2561_LUX_CHSCALE;
+            continue;
+        }
+        /* Short exposure clipped too, the result is a lower bound */
+        if (!(hdr->valid & 0x1) || (count_short > tsl2561_exposure_clip(&(hdr->exp[0]))))
+            hdr->sat = 1;
+        channel[ch] = ((uint64_t)count_short * tsl2561_exposure_scale(&(hdr->exp[0]))) >> TSL2561_LUX_CHSCALE;
+    }
+
+    /* Same fixed point formula as tsl2561_get_lux_package, in 64 bits as the
+       merged channels exceed 16 bits at 13ms/1x scale */
+    uint64_t ratio1 = 0;
+    if (channel[0] != 0)
+        ratio1 = (channel[1] << (TSL2561_LUX_RATIOSCALE + 1)) / channel[0];
+    uint64_t ratio = (ratio1 + 1) >> 1;
+
+    unsigned int b, m;
+    tsl2561_lux_coeff(ratio, TSL2561_PKG_DEFAULT, &b, &m);
+
+    uint64_t temp = 0;
+    channel[0] = channel[0] * b;
+    channel[1] = channel[1] * m;
+    if (channel[0] > channel[1])
+        temp = channel[0] - channel[1];
+    temp += (1 << (TSL2561_LUX_LUXSCALE - 1));
+    return temp >> TSL2561_LUX_LUXSCALE;
+}
+
+uint32_t tsl2561_hdr_push(tsl2561_hdr *hdr, uint32_t measure)
+{
+    hdr->measure[hdr->cur] = measure;
+    hdr->valid |= 1 << hdr->cur;
+    hdr->cur ^= 1;
+    return tsl2561_hdr_lux(hdr);
+}
+
+int tsl2561_hdr_step(tsl2561 *dev, tsl2561_hdr *hdr, uint32_t *lux)
+{
+    uint32_t measure;
+    if (tsl2561_measure(dev, &measure) < 0)
+        return -1;
+    *lux = tsl2561_hdr_push(hdr, measure);
+    // start the other exposure
+    if (tsl2561_set_timing(dev, hdr->exp[hdr->cur].gain, hdr->exp[hdr->cur].inttime) < 0)
+    {
+        eprintf("Error: Could not switch exposure");
+        return -1;
+    }
+    return 1;
+}
+
+static int tsl2561_probe_chn(tsl2561 *dev, i2carb_client *cl, int chn)
+{
+    // Read back the control register: a single short transfer that any
+    // TSL2561 answers whether powered or not, unlike the ID register
+    uint8_t cmd_buf[] = {TSL2561_COMMAND_BIT | TSL2561_REGISTER_CONTROL, 0x0};
+    if (tsl2561_xfer(dev, cl, chn, cmd_buf, 1, cmd_buf + 1, 1) < 0)
+    {
+        // the adapter reports an address NACK as ENXIO or EREMOTEIO
+        if (errno == ENXIO || errno == EREMOTEIO)
+            return 0;
+        eprintf("Error: Probe failed: %s", strerror(errno));
+        return -1;
+    }
+    uint8_t power = cmd_buf[1] & TSL2561_CONTROL_POWER_MASK;
+    if (power != TSL2561_CONTROL_POWERON && power != TSL2561_CONTROL_POWEROFF)
+    {
+        eprintf("Not a TSL2561, control register reads 0x%02x", cmd_buf[1]);
+        return 0;
+    }
+    return 1;
+}
+
+int tsl2561_probe(tsl2561 *dev)
+{
+    return tsl2561_probe_chn(dev, NULL, -1);
+}
+
+int tsl2561_probe_arb(tsl2561 *dev, i2carb_client *cl, int chn)
+{
+    return tsl2561_probe_chn(dev, cl, chn);
+}
+
+int tsl2561_power(tsl2561 *dev, int on)
+{
+    unsigned char cmd_buf[] = {TSL2561_COMMAND_BIT | TSL2561_REGISTER_CONTROL, on ? TSL2561_CONTROL_POWERON : TSL2561_CONTROL_POWEROFF};
+    if (unlikely(i2cbus_write(dev, cmd_buf, 2) != 2))
+    {
+        eprintf("Could not send power %s command", on ? "up" : "down");
+        return -1;
+    }
+    return 1;
+}
+
+int tsl2561_power_arb(tsl2561 *dev, i2carb_client *cl, int chn, int on)
+{
+    unsigned char cmd_buf[] = {TSL2561_COMMAND_BIT | TSL2561_REGISTER_CONTROL, on ? TSL2561_CONTROL_POWERON : TSL2561_CONTROL_POWEROFF};
+    if (unlikely(tsl2561_xfer(dev, cl, chn, cmd_buf, 2, NULL, 0) < 0))
+    {
+        eprintf("Could not send power %s command", on ? "up" : "down");
+        return -1;
+    }
+    return 1;
+}
+
 int tsl2561_destroy(tsl2561 *dev)
 {
     static unsigned char cmd_buf[] = {0x80, 0x0};
@@ -267,6 +627,17 @@ int tsl2561_destroy(tsl2561 *dev)
     return i2cbus_close(dev);
 }
 
+int tsl2561_destroy_arb(tsl2561 *dev, i2carb_client *cl, int chn)
+{
+    unsigned char cmd_buf[] = {0x80, 0x0};
+    if (tsl2561_xfer(dev, cl, chn, cmd_buf, 2, NULL, 0) != 2)
+    {
+        eprintf("Could not send power down command");
+        return -1;
+    }
+    return i2cbus_close(dev);
+}
+
 #ifdef UNIT_TEST_SINGLE
 #include <signal.h>
 #include <stdio.h>
@@ -283,11 +654,12 @@ void sighandler(int sig)
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc != 3 && argc != 4)
     {
-        printf("Invocation: ./%s <Bus ID> <Address (in hex)>\n\n", argv[0]);
+        printf("Invocation: ./%s <Bus ID> <Address (in hex)> [hdr]\n\n", argv[0]);
         return 0;
     }
+    int hdr_mode = (argc == 4) && (strcmp(argv[3], "hdr") == 0);
     int id = atoi(argv[1]);
     int addr = (int)strtol(argv[2], NULL, 16); // convert to hex
     if (!((addr == 0x29) || (addr == 0x39) || (addr == 0x49)))
@@ -302,7 +674,30 @@ int main(int argc, char *argv[])
         goto end;
     }
     signal(SIGINT, &sighandler);
-    while(!done)
+    tsl2561_hdr hdr[1];
+    if (hdr_mode && tsl2561_hdr_init(dev, hdr, NULL, NULL) < 0)
+    {
+        printf("Could not start HDR mode, exiting...\n");
+        goto end;
+    }
+    while(hdr_mode && !done)
+    {
+        uint32_t lux = 0;
+        uint32_t delay = tsl2561_hdr_delay_ms(hdr); // same 100 ms update unless the exposure is longer
+        usleep((delay < 100 ? 100 : delay) * 1000);
+        if (tsl2561_hdr_step(dev, hdr, &lux) < 0)
+        {
+            printf("main: Error taking measurement, exiting...\n");
+            break;
+        }
+        int num_char = printf("0x%08x 0x%08x | %05u%s", hdr->measure[0], hdr->measure[1], lux, hdr->sat ? " (sat)" : "");
+        fflush(stdout);
+        printf("\r");
+        while(num_char--)
+            printf(" ");
+        printf("\r");
+    }
+    while(!hdr_mode && !done)
     {
         unsigned int measure = 0x0;
         if (tsl2561_measure(dev, &measure) < 0)
@@ -332,6 +727,7 @@ end:
 #include <unistd.h>
 #include <papi.h>
 #include "tca9458a/tca9458a.h"
+#include "tsl2561_topo.h"
 
 volatile sig_atomic_t done = 0;
 void sighandler(int sig)
@@ -347,51 +743,54 @@ int main(int argc, char *argv[])
         eprintf("PAPI init error");
     }
     signal(SIGINT, &sighandler);
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("Invocation: sudo luxsensor <I2C Bus>\n\n");
+        printf("Invocation: sudo luxsensor <I2C Bus> [rescan]\n\n");
         goto end;
     }
     int bus = atoi(argv[1]);
-    int addr[] = {0x29, 0x39, 0x49};
-    tsl2561 **lux = (tsl2561 **)malloc(sizeof(tsl2561 *) * 9);
-    for (int i = 0; i < 9; i++)
-    {
-        lux[i] = (tsl2561 *)malloc(sizeof(tsl2561));
-    }
+    int rescan = (argc == 3) && (strcmp(argv[2], "rescan") == 0);
+    tsl2561 lux[TSL2561_TOPO_MAX];
+    tsl2561_sched_dev ent[TSL2561_TOPO_MAX];
+    tsl2561_topo topo[1];
     tca9458a mux[1];
     if (tca9458a_init(mux, bus, 0x70, -1) < 0)
     {
         eprintf("Initializing mux failed");
+        goto end;
     }
-    for (int i = 0; i < 9; i++)
+    int cached = tsl2561_topo_discover(topo, mux, NULL, bus, 0x70, TSL2561_TOPO_CACHE, rescan);
+    if (cached < 0)
     {
-        if ((i % 3) == 0) // switch mux
-        {
-            tca9458a_set(mux, i / 3);
-        }
-        if (tsl2561_init(lux[i], bus, addr[i % 3], -1) < 0)
-        {
-            eprintf("Error opening device on bus %d channel %d address 0x%02x, fd = %d\n", bus, i / 3, addr[i % 3], lux[i]->fd);
-        }
+        eprintf("Could not discover devices on bus %d", bus);
+        goto close_mux;
+    }
+    for (int i = 0; i < topo->num; i++)
+    {
+        if (topo->ent[i].chn == TSL2561_TOPO_NOMUX)
+            printf("Found device on bus %d, no mux, address 0x%02x\n", bus, topo->ent[i].addr);
         else
-            printf("Opened device on bus %d channel %d address 0x%02x, fd = %d\n", bus, i / 3, addr[i % 3], lux[i]->fd);
+            printf("Found device on bus %d channel %d address 0x%02x\n", bus, topo->ent[i].chn, topo->ent[i].addr);
     }
+    int num = tsl2561_topo_open(topo, mux, NULL, lux, ent);
+    printf("Opened %d of %d devices (%s topology)\n", num, topo->num, cached ? "cached" : "scanned");
     while (!done)
     {
         int charout = printf("Lux:");
-        uint32_t mes[9] = {0x0, };
+        uint32_t mes[TSL2561_TOPO_MAX] = {0x0, };
         long long s = PAPI_get_real_usec();
-        for (int i = 0; i < 9 && (!done); i++)
+        int cur_chn = -1;
+        for (int i = 0; i < num && (!done); i++)
         {
-            if ((i % 3) == 0) // switch mux
+            if (ent[i].chn >= 0 && ent[i].chn != cur_chn) // switch mux
             {
-                tca9458a_set(mux, i / 3);
+                tca9458a_set(mux, ent[i].chn);
+                cur_chn = ent[i].chn;
             }
-            tsl2561_measure(lux[i], &mes[i]);
+            tsl2561_measure(ent[i].dev, &mes[i]);
         }
         long long e = PAPI_get_real_usec();
-        for (int i = 0; i < 9 && (!done); i++)
+        for (int i = 0; i < num && (!done); i++)
             charout += printf(" %d", tsl2561_get_lux(mes[i]));
         charout += printf(" | Time: %lld us", e - s);
         fflush(stdout);
@@ -404,21 +803,10 @@ int main(int argc, char *argv[])
     }
     printf("Received Ctrl + C!\n");
     fflush(stdout);
-    for (int i = 0; i < 9; i++)
-    {
-        if ((i % 3) == 0) // switch mux
-        {
-            tca9458a_set(mux, i / 3);
-            printf("Set mux to channel %d\n", (i / 3) + 1);
-            fflush(stdout);
-            usleep(10 * 1000);
-        }
-        tsl2561_destroy(lux[i]);
-        usleep(10 * 1000);
-    }
-    tca9458a_set(mux, 8);; // disable mux
+    tsl2561_topo_close(ent, num, mux, NULL);
+close_mux:
+    tca9458a_set(mux, TSL2561_TOPO_MUX_OFF); // disable mux
     tca9458a_destroy(mux);
-    free(lux);
 end:
     return 0;
 }
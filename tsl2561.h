@@ -30,6 +30,11 @@ extern "C" {
 //#define TSL2561_PACKAGE_CS                ///< Chip scale package
 #define TSL2561_PACKAGE_T_FN_CL ///< Dual Flat No-Lead package
 
+// Merge the CH0 and CH1 word reads through the bus arbiter into one I2C block
+// read of all four data registers (command 0x9C, no byte count). Not yet
+// confirmed on hardware, so the two word reads are kept by default.
+//#define TSL2561_BLOCK_MERGE ///< Merge CH0/CH1 reads into one block read
+
 #define TSL2561_COMMAND_BIT (0x80) ///< Must be 1
 #define TSL2561_CLEAR_BIT (0x40)   ///< Clears any pending interrupt (write 1 to clear)
 #define TSL2561_WORD_BIT (0x20)    ///< 1 = read/write word (rather than byte)
@@ -37,6 +42,7 @@ extern "C" {
 
 #define TSL2561_CONTROL_POWERON (0x03)  ///< Control register setting to turn on
 #define TSL2561_CONTROL_POWEROFF (0x00) ///< Control register setting to turn off
+#define TSL2561_CONTROL_POWER_MASK (0x03) ///< Control register power bits, the rest are reserved
 
 #define TSL2561_LUX_LUXSCALE (14)          ///< Scale by 2^14
 #define TSL2561_LUX_RATIOSCALE (9)         ///< Scale ratio by 2^9
@@ -156,10 +162,62 @@ typedef enum
     TSL2561_GAIN_16X = 0x10, ///< 16x gain
 } tsl2561Gain_t;
 
+/**
+ * @brief Lux coefficient sets, selected at compile time for tsl2561_get_lux
+ * by TSL2561_PACKAGE_CS
+ * 
+ */
+typedef enum
+{
+    TSL2561_PKG_T_FN_CL = 0x00, ///< T, FN and CL package
+    TSL2561_PKG_CS = 0x01,      ///< Chip scale package
+} tsl2561Package_t;
+
+#ifdef TSL2561_PACKAGE_CS
+#define TSL2561_PKG_DEFAULT TSL2561_PKG_CS ///< Package used by tsl2561_get_lux
+#else
+#define TSL2561_PKG_DEFAULT TSL2561_PKG_T_FN_CL ///< Package used by tsl2561_get_lux
+#endif
+
+/**
+ * @brief Gain and integration time pair
+ * 
+ */
+typedef struct
+{
+    tsl2561Gain_t gain;               ///< Gain setting
+    tsl2561IntegrationTime_t inttime; ///< Integration time setting
+} tsl2561_exposure;
+
+/**
+ * @brief Dual-exposure HDR state. The device alternates between a short and
+ * a long exposure, and every step merges the latest measurement of each:
+ * channels that are not clipped in the long exposure are taken from it, the
+ * rest are taken from the short exposure, both scaled to a common fixed point
+ * scale. Lux is computed on the merged channels.
+ * 
+ * The range is still bounded by the short exposure. Its maximum count scales
+ * with integration time (5047 at 13.7ms, 37177 at 101ms), i.e. the ADC tops
+ * out at a fixed count rate, so a shorter (e.g. manual) integration does not
+ * extend it. The default short exposure of 13.7ms at 1x is therefore the
+ * widest the sensor offers. When a channel clips there too, the merged lux is
+ * a lower bound and sat is set, where tsl2561_get_lux would return 65536.
+ * 
+ */
+typedef struct
+{
+    tsl2561_exposure exp[2]; ///< Short ([0]) and long ([1]) exposure settings
+    uint32_t measure[2];     ///< Latest raw measurement at each exposure
+    uint8_t valid;           ///< Bit i set once measure[i] holds a measurement
+    uint8_t cur;             ///< Exposure the device is integrating now
+    uint8_t sat;             ///< Set if the last lux used a clipped short exposure channel, i.e. is a lower bound
+} tsl2561_hdr;
+
 /******************************************************************************/
 #define TSL2561_BLOCK_READ 0x0B ///< Block read mask
 
 #include <i2cbus/i2cbus.h>
+#include "i2carb.h"
 /**
  * @brief TSL2561 Device Handle
  * 
@@ -176,9 +234,24 @@ typedef i2cbus tsl2561;
  * @param id I2C Bus ID
  * @param addr Device Address
  * @param ctx Device context
- * @return int Status of i2cbus_open call
+ * @return int 1 on success, -1 on failure. If setup fails after the bus was
+ * opened, the device is powered down and the handle closed.
  */
 int tsl2561_init(tsl2561 *dev, int id, int addr, int ctx);
+/**
+ * @brief Opens a TSL2561 Lux sensor like tsl2561_init, with all bus traffic
+ * going through a bus arbiter
+ * 
+ * @param dev tsl2561 device handle, which is an alias to i2cbus handle
+ * @param cl Arbiter client the transfers are accounted to
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ * @param id I2C Bus ID
+ * @param addr Device Address
+ * @param ctx Device context
+ * @return int 1 on success, -1 on failure, with the handle closed as in
+ * tsl2561_init
+ */
+int tsl2561_init_arb(tsl2561 *dev, i2carb_client *cl, int chn, int id, int addr, int ctx);
 /**
  * @brief Get a measurement and store it in the 
  * 
@@ -188,6 +261,20 @@ int tsl2561_init(tsl2561 *dev, int id, int addr, int ctx);
  * @return int Return status of i2cbus_read
  */
 int tsl2561_measure(tsl2561 *dev, uint32_t *measure);
+/**
+ * @brief Get a measurement through a bus arbiter. CH0 and CH1 are queued
+ * together, and read in a single I2C block read if TSL2561_BLOCK_MERGE is
+ * defined.
+ * 
+ * @param dev Handle to tsl2561 device
+ * @param cl Arbiter client the transfers are accounted to
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ * @param deadline_us Completion deadline on the i2carb_now_us() clock, 0 for none
+ * @param measure Pointer to uint32 where measurement is stored
+ * 
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_measure_arb(tsl2561 *dev, i2carb_client *cl, int chn, uint64_t deadline_us, uint32_t *measure);
 /**
  * @brief Convert a raw TSL2561 measurement to lux
  * 
@@ -195,12 +282,157 @@ int tsl2561_measure(tsl2561 *dev, uint32_t *measure);
  * @return uint32_t Lux output from measurement
  */
 uint32_t tsl2561_get_lux(uint32_t measure);
+/**
+ * @brief Convert a raw TSL2561 measurement to lux using the coefficients of
+ * the given package. This is the reference conversion kernel.
+ * 
+ * @param measure Measurement using tsl2561_measure
+ * @param package Package coefficient set
+ * @return uint32_t Lux output from measurement
+ */
+uint32_t tsl2561_get_lux_package(uint32_t measure, tsl2561Package_t package);
+/**
+ * @brief Check whether a TSL2561 answers at the address dev was opened with.
+ * Only the control register is read, the ID register is left alone. Another
+ * device acknowledging at the address is rejected unless the power bits read
+ * back as on or off; the reserved bits are ignored.
+ * 
+ * @param dev tsl2561 device handle, opened with i2cbus_open
+ * @return int 1 if a TSL2561 responded, 0 if nothing acknowledged or another
+ * device answered, -1 on any other bus error
+ */
+int tsl2561_probe(tsl2561 *dev);
+/**
+ * @brief Probe a TSL2561 through a bus arbiter
+ * 
+ * @param dev tsl2561 device handle, opened with i2cbus_open
+ * @param cl Arbiter client the transfer is accounted to
+ * @param chn Mux channel to probe behind, -1 to leave the mux alone
+ * @return int 1 if a TSL2561 responded, 0 if nothing acknowledged or another
+ * device answered, -1 on any other bus error
+ */
+int tsl2561_probe_arb(tsl2561 *dev, i2carb_client *cl, int chn);
+/**
+ * @brief Power the device up or down by writing to the control register.
+ * Register contents are retained while powered down, and an integration
+ * cycle starts on power up.
+ * 
+ * @param dev tsl2561 device handle
+ * @param on 1 to power up, 0 to power down
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_power(tsl2561 *dev, int on);
+/**
+ * @brief Power the device up or down through a bus arbiter
+ * 
+ * @param dev tsl2561 device handle
+ * @param cl Arbiter client the transfer is accounted to
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ * @param on 1 to power up, 0 to power down
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_power_arb(tsl2561 *dev, i2carb_client *cl, int chn, int on);
+/**
+ * @brief Set gain and integration time. The device is power cycled around the
+ * write, so a new integration starts with the new setting.
+ * 
+ * @param dev tsl2561 device handle
+ * @param gain Gain setting
+ * @param inttime Integration time setting
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_set_timing(tsl2561 *dev, tsl2561Gain_t gain, tsl2561IntegrationTime_t inttime);
+/**
+ * @brief Write gain and integration time without touching the power state.
+ * The setting applies from the next integration cycle started by a power up.
+ * 
+ * @param dev tsl2561 device handle
+ * @param gain Gain setting
+ * @param inttime Integration time setting
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_write_timing(tsl2561 *dev, tsl2561Gain_t gain, tsl2561IntegrationTime_t inttime);
+/**
+ * @brief Write gain and integration time through a bus arbiter
+ * 
+ * @param dev tsl2561 device handle
+ * @param cl Arbiter client the transfer is accounted to
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ * @param gain Gain setting
+ * @param inttime Integration time setting
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_write_timing_arb(tsl2561 *dev, i2carb_client *cl, int chn, tsl2561Gain_t gain, tsl2561IntegrationTime_t inttime);
+/**
+ * @brief Fill in HDR state starting with the short exposure, without touching
+ * the bus. The caller programs hdr->exp[hdr->cur] before the next integration.
+ * 
+ * @param hdr HDR state
+ * @param exp_short Short exposure, NULL for 13ms at 1x
+ * @param exp_long Long exposure, NULL for 13ms at 16x
+ */
+void tsl2561_hdr_reset(tsl2561_hdr *hdr, const tsl2561_exposure *exp_short, const tsl2561_exposure *exp_long);
+/**
+ * @brief Start dual-exposure HDR mode on a device, beginning with the short
+ * exposure
+ * 
+ * @param dev tsl2561 device handle
+ * @param hdr HDR state
+ * @param exp_short Short exposure, NULL for 13ms at 1x
+ * @param exp_long Long exposure, NULL for 13ms at 16x
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_hdr_init(tsl2561 *dev, tsl2561_hdr *hdr, const tsl2561_exposure *exp_short, const tsl2561_exposure *exp_long);
+/**
+ * @brief Read the exposure that just completed, start the other one, and
+ * merge the latest short and long measurements. Call again after
+ * tsl2561_hdr_delay_ms().
+ * 
+ * @param dev tsl2561 device handle
+ * @param hdr HDR state
+ * @param lux Pointer to uint32 where merged lux is stored
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_hdr_step(tsl2561 *dev, tsl2561_hdr *hdr, uint32_t *lux);
+/**
+ * @brief Record the measurement of the exposure that just completed, advance
+ * to the other exposure and merge, without touching the bus. The caller
+ * programs hdr->exp[hdr->cur] before the next integration.
+ * 
+ * @param hdr HDR state
+ * @param measure Measurement of exposure hdr->cur
+ * @return uint32_t Merged lux, see tsl2561_hdr_lux
+ */
+uint32_t tsl2561_hdr_push(tsl2561_hdr *hdr, uint32_t measure);
+/**
+ * @brief Merge the latest short and long measurements into lux
+ * 
+ * @param hdr HDR state
+ * @return uint32_t Lux, 0 before the first measurement, a lower bound if
+ * hdr->sat is set on return
+ */
+uint32_t tsl2561_hdr_lux(tsl2561_hdr *hdr);
+/**
+ * @brief Time to wait for the exposure in progress to complete
+ * 
+ * @param hdr HDR state
+ * @return uint32_t One of TSL2561_DELAY_INTTIME_*
+ */
+uint32_t tsl2561_hdr_delay_ms(const tsl2561_hdr *hdr);
 /**
  * @brief Close I2C bus corresponding to the device
  * 
  * @param dev tsl2561 device handle
  */
 int tsl2561_destroy(tsl2561 *dev);
+/**
+ * @brief Power down the device through a bus arbiter and close its I2C bus
+ * 
+ * @param dev tsl2561 device handle
+ * @param cl Arbiter client the transfer is accounted to
+ * @param chn Mux channel the device sits behind, -1 if not behind the mux
+ */
+int tsl2561_destroy_arb(tsl2561 *dev, i2carb_client *cl, int chn);
 #ifdef __cplusplus
 }
 #endif
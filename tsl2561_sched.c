@@ -0,0 +1,481 @@
+/**
+ * @file tsl2561_sched.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Adaptive sampling rate controller and scheduler for arrays of TSL2561
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tsl2561_sched.h"
+
+#define eprintf(str, ...) \
+    fprintf(stderr, "%s, %d: " str "\n", __func__, __LINE__, ##__VA_ARGS__); \
+    fflush(stderr)
+
+void tsl2561_rate_init(tsl2561_rate *rate, uint32_t min_period_ms, uint32_t max_period_ms)
+{
+    if (min_period_ms == 0)
+        min_period_ms = 1;
+    if (max_period_ms < min_period_ms)
+        max_period_ms = min_period_ms;
+    rate->last = 0;
+    rate->period_ms = min_period_ms;
+    rate->min_period_ms = min_period_ms;
+    rate->max_period_ms = max_period_ms;
+    rate->thres = TSL2561_RATE_THRES;
+    rate->shift = TSL2561_RATE_SHIFT;
+    rate->valid = 0;
+}
+
+static inline uint16_t absdiff16(uint16_t a, uint16_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+uint32_t tsl2561_rate_update(tsl2561_rate *rate, uint32_t measure)
+{
+    if (!rate->valid)
+    {
+        rate->last = measure;
+        rate->valid = 1;
+        rate->period_ms = rate->min_period_ms;
+        return rate->period_ms;
+    }
+    uint16_t ch0 = measure >> 16, ch1 = measure;
+    uint16_t d0 = absdiff16(ch0, rate->last >> 16);
+    uint16_t d1 = absdiff16(ch1, rate->last);
+    uint16_t delta = d0 > d1 ? d0 : d1;
+    // threshold scales with the signal level so that shot noise on a bright
+    // but steady signal still counts as flat
+    uint16_t level = ch0 > ch1 ? ch0 : ch1;
+    uint16_t thres = level >> rate->shift;
+    if (thres < rate->thres)
+        thres = rate->thres;
+    rate->last = measure;
+
+    if (delta > thres) // transient, sample as fast as allowed
+    {
+        rate->period_ms = rate->min_period_ms;
+    }
+    else if (delta <= (thres >> 1)) // flat, back off
+    {
+        uint32_t period = rate->period_ms << 1;
+        rate->period_ms = period > rate->max_period_ms ? rate->max_period_ms : period;
+    }
+    // in between: hold the current period
+    return rate->period_ms;
+}
+
+int tsl2561_sched_init(tsl2561_sched *sched, tsl2561_sched_dev *devs, int num, tca9458a *mux, uint32_t min_period_ms, uint32_t max_period_ms)
+{
+    if (sched == NULL || devs == NULL || num <= 0)
+    {
+        eprintf("Error: Invalid arguments");
+        return -1;
+    }
+    for (int i = 0; i < num; i++)
+    {
+        if (devs[i].chn >= 0 && mux == NULL)
+        {
+            eprintf("Error: Device %d is on mux channel %d but no mux was provided", i, devs[i].chn);
+            return -1;
+        }
+        tsl2561_rate_init(&(devs[i].rate), min_period_ms, max_period_ms);
+        devs[i].due_ms = 0;
+        devs[i].measure = 0;
+        devs[i].lux = 0;
+        devs[i].hdr = NULL;
+        devs[i].status = 0;
+    }
+    sched->devs = devs;
+    sched->num = num;
+    sched->mux = mux;
+    sched->cur_chn = -1;
+    sched->samples = 0;
+    sched->skipped = 0;
+    sched->xfers = 0;
+    sched->duty = 0;
+    sched->inttime_ms = 0;
+    sched->on_us = 0;
+    sched->duty_start_us = 0;
+    sched->cl = NULL;
+    return 1;
+}
+
+/**
+ * @brief Call fn on every device with mask[i] set, grouped by mux channel.
+ * Devices on the currently selected channel (and those not behind the mux) go
+ * first, then the lowest remaining channel, so each channel is selected once.
+ *
+ * @return int 1 on success, -1 if the mux could not be set
+ */
+static int tsl2561_sched_foreach(tsl2561_sched *sched, const uint8_t *mask, void (*fn)(tsl2561_sched *, tsl2561_sched_dev *, void *), void *arg)
+{
+    uint8_t done[sched->num];
+    for (int i = 0; i < sched->num; i++)
+        done[i] = !mask[i];
+    while (1)
+    {
+        int next_chn = -1;
+        for (int i = 0; i < sched->num; i++)
+        {
+            tsl2561_sched_dev *ent = &(sched->devs[i]);
+            if (done[i])
+                continue;
+            if (ent->chn < 0 || ent->chn == sched->cur_chn)
+            {
+                fn(sched, ent, arg);
+                done[i] = 1;
+            }
+            else if (next_chn < 0 || ent->chn < next_chn)
+            {
+                next_chn = ent->chn;
+            }
+        }
+        if (next_chn < 0)
+            break;
+        // the arbiter switches the mux itself when it runs the transfer, but
+        // the switch is still a transaction on the bus
+        sched->xfers++;
+        if (sched->cl == NULL)
+        {
+            if (tca9458a_set(sched->mux, next_chn) < 0)
+            {
+                eprintf("Error: Could not set mux channel %d", next_chn);
+                sched->cur_chn = -1;
+                return -1;
+            }
+        }
+        sched->cur_chn = next_chn;
+    }
+    return 1;
+}
+
+static int tsl2561_sched_measure(tsl2561_sched *sched, tsl2561_sched_dev *ent)
+{
+    int status;
+    sched->samples++;
+    if (sched->cl != NULL)
+    {
+#ifdef TSL2561_BLOCK_MERGE
+        sched->xfers++; // CH0 and CH1 are merged by the arbiter
+#else
+        sched->xfers += 2;
+#endif
+        status = tsl2561_measure_arb(ent->dev, sched->cl, ent->chn, 0, &(ent->measure));
+    }
+    else
+    {
+        sched->xfers += 2; // tsl2561_measure reads CH0 and CH1 separately
+        status = tsl2561_measure(ent->dev, &(ent->measure));
+    }
+    if (status < 0)
+        return status;
+    ent->lux = ent->hdr != NULL ? tsl2561_hdr_push(ent->hdr, ent->measure) : tsl2561_get_lux(ent->measure);
+    return status;
+}
+
+static int tsl2561_sched_power_dev(tsl2561_sched *sched, tsl2561_sched_dev *ent, int on)
+{
+    sched->xfers++;
+    if (sched->cl != NULL)
+        return tsl2561_power_arb(ent->dev, sched->cl, ent->chn, on);
+    return tsl2561_power(ent->dev, on);
+}
+
+/**
+ * @brief Program the exposure an HDR device integrates next. A powered device
+ * is power cycled around the write so that the integration restarts with it,
+ * a powered down device picks it up at the next power up.
+ *
+ */
+static int tsl2561_sched_expose(tsl2561_sched *sched, tsl2561_sched_dev *ent, int powered)
+{
+    const tsl2561_exposure *exp = &(ent->hdr->exp[ent->hdr->cur]);
+    if (powered && tsl2561_sched_power_dev(sched, ent, 0) < 0)
+        return -1;
+    sched->xfers++;
+    int status = sched->cl != NULL ? tsl2561_write_timing_arb(ent->dev, sched->cl, ent->chn, exp->gain, exp->inttime)
+                                   : tsl2561_write_timing(ent->dev, exp->gain, exp->inttime);
+    if (status < 0)
+        return -1;
+    if (powered && tsl2561_sched_power_dev(sched, ent, 1) < 0)
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief Time from power up until the device has a conversion ready
+ *
+ */
+static uint32_t tsl2561_sched_delay_ms(tsl2561_sched *sched, tsl2561_sched_dev *ent)
+{
+    return ent->hdr != NULL ? tsl2561_hdr_delay_ms(ent->hdr) : sched->inttime_ms;
+}
+
+static void tsl2561_sched_reschedule(tsl2561_sched_dev *ent, uint64_t now_ms)
+{
+    if (ent->status < 0)
+    {
+        // keep polling a failing device at the fastest rate
+        ent->due_ms = now_ms + ent->rate.min_period_ms;
+        return;
+    }
+    uint32_t period;
+    if (ent->hdr == NULL)
+        period = tsl2561_rate_update(&(ent->rate), ent->measure);
+    else if (ent->hdr->cur == 1)
+        // short exposure just read: feed the controller one exposure only, so
+        // that alternating exposures do not look like a transient
+        period = tsl2561_rate_update(&(ent->rate), ent->hdr->measure[0]);
+    else
+        period = ent->rate.period_ms;
+    ent->due_ms = now_ms + period;
+}
+
+static void tsl2561_sched_service(tsl2561_sched *sched, tsl2561_sched_dev *ent, void *arg)
+{
+    ent->status = tsl2561_sched_measure(sched, ent);
+    if (ent->hdr == NULL)
+    {
+        tsl2561_sched_reschedule(ent, *(uint64_t *)arg);
+        return;
+    }
+    // start the other exposure, ready one integration after the restart
+    if (ent->status >= 0)
+        ent->status = tsl2561_sched_expose(sched, ent, 1);
+    uint64_t start_ms = tsl2561_sched_now_ms();
+    tsl2561_sched_reschedule(ent, *(uint64_t *)arg);
+    if (ent->due_ms < start_ms + tsl2561_sched_delay_ms(sched, ent))
+        ent->due_ms = start_ms + tsl2561_sched_delay_ms(sched, ent);
+}
+
+typedef struct
+{
+    uint64_t *on_us;  ///< Power up timestamp, 0 if the device did not power up
+    uint8_t *visited; ///< Set once the power up pass reached the device
+} tsl2561_sched_batch;
+
+static void tsl2561_sched_power_up(tsl2561_sched *sched, tsl2561_sched_dev *ent, void *arg)
+{
+    tsl2561_sched_batch *batch = (tsl2561_sched_batch *)arg;
+    int idx = ent - sched->devs;
+    batch->visited[idx] = 1;
+    ent->status = tsl2561_sched_power_dev(sched, ent, 1);
+    if (ent->status >= 0)
+        batch->on_us[idx] = tsl2561_sched_now_us();
+}
+
+static void tsl2561_sched_read_down(tsl2561_sched *sched, tsl2561_sched_dev *ent, void *arg)
+{
+    uint64_t *on_us = ((tsl2561_sched_batch *)arg)->on_us;
+    uint32_t inttime_ms = tsl2561_sched_delay_ms(sched, ent); // exposure that just integrated
+    if (ent->status >= 0)
+        ent->status = tsl2561_sched_measure(sched, ent);
+    // power down regardless, a failed power up may still have gone through
+    if (tsl2561_sched_power_dev(sched, ent, 0) < 0)
+        ent->status = -1;
+    uint64_t off_us = tsl2561_sched_now_us();
+    if (on_us[ent - sched->devs]) // not counted if the power up failed
+        sched->on_us += off_us - on_us[ent - sched->devs];
+    // the next exposure is programmed while off and starts at the next power up
+    if (ent->hdr != NULL && ent->status >= 0)
+        ent->status = tsl2561_sched_expose(sched, ent, 0);
+    // the poll blocked for the integration, so schedule from power down and
+    // keep the device off for at least one integration time
+    uint64_t off_ms = off_us / 1000;
+    tsl2561_sched_reschedule(ent, off_ms);
+    if (ent->due_ms < off_ms + inttime_ms)
+        ent->due_ms = off_ms + inttime_ms;
+}
+
+int tsl2561_sched_poll(tsl2561_sched *sched, uint64_t now_ms)
+{
+    int num_due = 0;
+    uint8_t due[sched->num];
+    for (int i = 0; i < sched->num; i++)
+    {
+        due[i] = sched->devs[i].due_ms <= now_ms;
+        if (due[i])
+            num_due++;
+        else
+            sched->skipped++;
+    }
+    if (num_due == 0)
+        return 0;
+    if (!sched->duty)
+    {
+        if (tsl2561_sched_foreach(sched, due, &tsl2561_sched_service, &now_ms) < 0)
+            return -1;
+        return num_due;
+    }
+    // Duty-cycled: power up the whole batch, wait one integration, then read
+    // and power down. The second pass starts on the channel the first pass
+    // ended on, so the batch costs 2 * (channels) - 1 mux switches.
+    uint64_t on_us[sched->num];
+    uint8_t visited[sched->num];
+    memset(on_us, 0, sizeof(on_us));
+    memset(visited, 0, sizeof(visited));
+    tsl2561_sched_batch batch = {on_us, visited};
+    int status = tsl2561_sched_foreach(sched, due, &tsl2561_sched_power_up, &batch);
+    // wait for the device that completes its integration last
+    uint64_t ready_us = 0;
+    for (int i = 0; i < sched->num; i++)
+    {
+        uint64_t ready = on_us[i] + (uint64_t)tsl2561_sched_delay_ms(sched, &(sched->devs[i])) * 1000;
+        if (due[i] && on_us[i] && ready > ready_us)
+            ready_us = ready;
+    }
+    uint64_t now_us = tsl2561_sched_now_us();
+    if (ready_us > now_us)
+        usleep(ready_us - now_us);
+    // power down every device the first pass reached, including those whose
+    // power up failed, and drop the rest if the pass failed midway
+    if (status < 0)
+    {
+        for (int i = 0; i < sched->num; i++)
+        {
+            if (due[i] && !visited[i])
+            {
+                due[i] = 0;
+                sched->devs[i].status = -1;
+                sched->devs[i].due_ms = now_ms + sched->devs[i].rate.min_period_ms;
+            }
+        }
+    }
+    if (tsl2561_sched_foreach(sched, due, &tsl2561_sched_read_down, &batch) < 0 || status < 0)
+        return -1;
+    return num_due;
+}
+
+static void tsl2561_sched_power(tsl2561_sched *sched, tsl2561_sched_dev *ent, void *arg)
+{
+    int *status = (int *)arg;
+    if (tsl2561_sched_power_dev(sched, ent, sched->duty ? 0 : 1) < 0)
+        *status = -1;
+}
+
+void tsl2561_sched_set_arbiter(tsl2561_sched *sched, i2carb_client *cl)
+{
+    sched->cl = cl;
+    sched->cur_chn = -1; // the arbiter may have moved the mux
+}
+
+int tsl2561_sched_set_duty_cycle(tsl2561_sched *sched, int enable, tsl2561IntegrationTime_t inttime)
+{
+    int status = 1;
+    uint8_t all[sched->num];
+    memset(all, 1, sizeof(all));
+    switch (inttime)
+    {
+    case TSL2561_INTEGRATIONTIME_13MS:
+        sched->inttime_ms = TSL2561_DELAY_INTTIME_13MS;
+        break;
+    case TSL2561_INTEGRATIONTIME_101MS:
+        sched->inttime_ms = TSL2561_DELAY_INTTIME_101MS;
+        break;
+    default:
+        sched->inttime_ms = TSL2561_DELAY_INTTIME_402MS;
+        break;
+    }
+    sched->duty = enable ? 1 : 0;
+    sched->on_us = 0;
+    sched->duty_start_us = tsl2561_sched_now_us();
+    if (tsl2561_sched_foreach(sched, all, &tsl2561_sched_power, &status) < 0)
+        return -1;
+    if (!sched->duty)
+    {
+        // first conversion is ready one integration after power up
+        uint64_t now_ms = tsl2561_sched_now_ms();
+        for (int i = 0; i < sched->num; i++)
+        {
+            uint64_t due_ms = now_ms + tsl2561_sched_delay_ms(sched, &(sched->devs[i]));
+            if (sched->devs[i].due_ms < due_ms)
+                sched->devs[i].due_ms = due_ms;
+        }
+    }
+    return status;
+}
+
+static void tsl2561_sched_hdr_start(tsl2561_sched *sched, tsl2561_sched_dev *ent, void *arg)
+{
+    int *status = (int *)arg;
+    if (tsl2561_sched_expose(sched, ent, !sched->duty) < 0)
+    {
+        ent->status = -1;
+        *status = -1;
+    }
+}
+
+int tsl2561_sched_set_hdr(tsl2561_sched *sched, tsl2561_hdr *hdr, const tsl2561_exposure *exp_short, const tsl2561_exposure *exp_long)
+{
+    int status = 1;
+    uint8_t all[sched->num];
+    memset(all, 1, sizeof(all));
+    for (int i = 0; i < sched->num; i++)
+    {
+        tsl2561_hdr_reset(&(hdr[i]), exp_short, exp_long);
+        sched->devs[i].hdr = &(hdr[i]);
+    }
+    if (tsl2561_sched_foreach(sched, all, &tsl2561_sched_hdr_start, &status) < 0)
+        return -1;
+    if (!sched->duty)
+    {
+        // the short exposure restarted on every device
+        uint64_t now_ms = tsl2561_sched_now_ms();
+        for (int i = 0; i < sched->num; i++)
+        {
+            uint64_t due_ms = now_ms + tsl2561_sched_delay_ms(sched, &(sched->devs[i]));
+            if (sched->devs[i].due_ms < due_ms)
+                sched->devs[i].due_ms = due_ms;
+        }
+    }
+    return status;
+}
+
+double tsl2561_sched_duty(tsl2561_sched *sched)
+{
+    if (!sched->duty)
+        return 1.0;
+    uint64_t elapsed_us = tsl2561_sched_now_us() - sched->duty_start_us;
+    if (elapsed_us == 0)
+        return 0.0;
+    return (double)sched->on_us / ((double)elapsed_us * sched->num);
+}
+
+double tsl2561_sched_samples_per_xfer(tsl2561_sched *sched)
+{
+    if (sched->xfers == 0)
+        return 0.0;
+    return (double)sched->samples / sched->xfers;
+}
+
+uint64_t tsl2561_sched_next(tsl2561_sched *sched)
+{
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < sched->num; i++)
+    {
+        if (sched->devs[i].due_ms < next)
+            next = sched->devs[i].due_ms;
+    }
+    return next;
+}
+
+uint64_t tsl2561_sched_now_ms(void)
+{
+    return tsl2561_sched_now_us() / 1000;
+}
+
+uint64_t tsl2561_sched_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,203 @@
+/**
+ * @file tsl2561_sched.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Adaptive sampling rate controller and scheduler for arrays of TSL2561
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+
+#ifndef TSL2561_SCHED_H
+#define TSL2561_SCHED_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include "tsl2561.h"
+#include "i2carb.h"
+#include <tca9458a/tca9458a.h>
+
+#define TSL2561_SCHED_MIN_PERIOD_MS (100)  ///< Fastest sampling period, matches the old fixed loop
+#define TSL2561_SCHED_MAX_PERIOD_MS (1600) ///< Slowest sampling period for a flat signal
+#define TSL2561_RATE_THRES (8)             ///< Absolute change (counts) below which the signal is flat
+#define TSL2561_RATE_SHIFT (5)             ///< Relative change threshold, level >> shift (~3%)
+
+/**
+ * @brief Per-device adaptive sampling rate controller state.
+ * The period doubles (up to max_period_ms) while the raw channels stay flat,
+ * and snaps back to min_period_ms as soon as either channel moves by more than
+ * the threshold.
+ *
+ */
+typedef struct
+{
+    uint32_t last;          ///< Last raw measurement (CH0 << 16 | CH1)
+    uint32_t period_ms;     ///< Current sampling period
+    uint32_t min_period_ms; ///< Fastest allowed sampling period
+    uint32_t max_period_ms; ///< Slowest allowed sampling period
+    uint16_t thres;         ///< Absolute change threshold in counts
+    uint8_t shift;          ///< Relative change threshold, level >> shift
+    uint8_t valid;          ///< Set once last holds a measurement
+} tsl2561_rate;
+
+/**
+ * @brief Device entry in a scheduler. The caller fills in dev and chn,
+ * tsl2561_sched_init() resets the rest.
+ *
+ */
+typedef struct
+{
+    tsl2561 *dev;      ///< Device handle
+    int chn;           ///< Mux channel the device sits behind, -1 if not behind the mux
+    tsl2561_rate rate; ///< Rate controller state
+    uint64_t due_ms;   ///< Time at which the device next needs service
+    uint32_t measure;  ///< Latest raw measurement
+    uint32_t lux;      ///< Latest lux, merged across exposures in HDR mode
+    tsl2561_hdr *hdr;  ///< HDR state, NULL for a single exposure
+    int status;        ///< Return status of the latest tsl2561_measure
+} tsl2561_sched_dev;
+
+/**
+ * @brief Scheduler servicing an array of TSL2561 devices behind a TCA9458A mux
+ *
+ */
+typedef struct
+{
+    tsl2561_sched_dev *devs; ///< Array of device entries
+    int num;                 ///< Number of device entries
+    tca9458a *mux;           ///< Mux handle, NULL if no device is behind a mux
+    int cur_chn;             ///< Mux channel currently selected, -1 if unknown
+    uint64_t samples;        ///< Number of measurements taken
+    uint64_t skipped;        ///< Number of device polls skipped because the device was not due
+    uint64_t xfers;          ///< Number of bus transactions issued (measurements, control writes and mux switches)
+    int duty;                ///< Duty-cycled mode, devices are powered only for one integration per sample
+    uint32_t inttime_ms;     ///< Wait after power up in duty-cycled mode, one of TSL2561_DELAY_INTTIME_*
+    uint64_t on_us;          ///< Total time devices spent powered up in duty-cycled mode
+    uint64_t duty_start_us;  ///< Time at which duty-cycled mode was enabled
+    i2carb_client *cl;       ///< Bus arbiter client, NULL to access the bus and mux directly
+} tsl2561_sched;
+
+/**
+ * @brief Initialize rate controller with the given period limits
+ *
+ * @param rate Rate controller state
+ * @param min_period_ms Fastest sampling period in ms
+ * @param max_period_ms Slowest sampling period in ms
+ */
+void tsl2561_rate_init(tsl2561_rate *rate, uint32_t min_period_ms, uint32_t max_period_ms);
+/**
+ * @brief Feed a raw measurement to the rate controller
+ *
+ * @param rate Rate controller state
+ * @param measure Measurement using tsl2561_measure
+ * @return uint32_t Sampling period in ms until the next measurement
+ */
+uint32_t tsl2561_rate_update(tsl2561_rate *rate, uint32_t measure);
+/**
+ * @brief Initialize a scheduler over devs. All devices are due immediately.
+ *
+ * @param sched Scheduler handle
+ * @param devs Array of device entries, dev and chn filled in by the caller
+ * @param num Number of device entries
+ * @param mux Mux handle, can be NULL if no entry has chn >= 0
+ * @param min_period_ms Fastest sampling period in ms
+ * @param max_period_ms Slowest sampling period in ms
+ * @return int 1 on success, -1 on invalid arguments
+ */
+int tsl2561_sched_init(tsl2561_sched *sched, tsl2561_sched_dev *devs, int num, tca9458a *mux, uint32_t min_period_ms, uint32_t max_period_ms);
+/**
+ * @brief Measure every device that is due at now_ms, grouped by mux channel
+ * so that each channel is selected at most once per poll.
+ *
+ * @param sched Scheduler handle
+ * @param now_ms Current time from tsl2561_sched_now_ms()
+ * @return int Number of devices serviced, -1 if the mux could not be set
+ */
+int tsl2561_sched_poll(tsl2561_sched *sched, uint64_t now_ms);
+/**
+ * @brief Route all bus traffic of the scheduler through a bus arbiter client.
+ * The arbiter then owns the mux, and with TSL2561_BLOCK_MERGE CH0/CH1 of each
+ * device are read in one merged transfer.
+ *
+ * @param sched Scheduler handle
+ * @param cl Arbiter client, NULL to go back to direct bus access
+ */
+void tsl2561_sched_set_arbiter(tsl2561_sched *sched, i2carb_client *cl);
+/**
+ * @brief Enable or disable duty-cycled acquisition. When enabled, all devices
+ * are powered down, and each poll powers up every due device in one pass over
+ * the mux channels, waits until the longest integration in the batch is done,
+ * then reads and powers down each device in a second pass. When disabled, all
+ * devices are powered up again and become due after one integration time.
+ *
+ * In duty-cycled mode a device is rescheduled from the time it was powered
+ * down, and stays off for at least one integration time, so a device is on
+ * for one integration per cycle of integration + max(period, integration).
+ * The duty cycle is therefore at most ~50% during transients, and at least
+ * inttime / (inttime + max_period_ms) on a flat signal.
+ *
+ * @param sched Scheduler handle
+ * @param enable 1 to enable, 0 to disable
+ * @param inttime Integration time the devices are configured with, HDR
+ * devices use the integration time of their current exposure instead
+ * @return int 1 on success, -1 if any device or the mux could not be accessed
+ */
+int tsl2561_sched_set_duty_cycle(tsl2561_sched *sched, int enable, tsl2561IntegrationTime_t inttime);
+/**
+ * @brief Put every device in dual-exposure HDR mode. Each measurement reads
+ * the exposure that just completed and programs the other one, so every
+ * sample yields a merged lux in the device entry at the sampling rate set by
+ * the rate controller, fed with the short exposure only. The scheduler
+ * issues all power and timing transfers itself, through the arbiter if one is
+ * set: in duty-cycled mode the next exposure is written while the device is
+ * powered down, otherwise the device is power cycled around the write and
+ * becomes due once the new exposure has integrated. HDR mode stays on for
+ * the lifetime of the scheduler.
+ *
+ * @param sched Scheduler handle
+ * @param hdr Array of sched->num HDR states, one per device entry
+ * @param exp_short Short exposure, NULL for 13ms at 1x
+ * @param exp_long Long exposure, NULL for 13ms at 16x
+ * @return int 1 on success, -1 if any device or the mux could not be accessed
+ */
+int tsl2561_sched_set_hdr(tsl2561_sched *sched, tsl2561_hdr *hdr, const tsl2561_exposure *exp_short, const tsl2561_exposure *exp_long);
+/**
+ * @brief Fraction of time the devices were powered up since duty-cycled mode
+ * was enabled, averaged over all devices
+ *
+ * @param sched Scheduler handle
+ * @return double Duty cycle in [0, 1], 1 if duty-cycled mode is disabled
+ */
+double tsl2561_sched_duty(tsl2561_sched *sched);
+/**
+ * @brief Samples taken per bus transaction since the scheduler was initialized
+ *
+ * @param sched Scheduler handle
+ * @return double Samples per transaction
+ */
+double tsl2561_sched_samples_per_xfer(tsl2561_sched *sched);
+/**
+ * @brief Time at which the next device becomes due
+ *
+ * @param sched Scheduler handle
+ * @return uint64_t Time in ms on the tsl2561_sched_now_ms() clock
+ */
+uint64_t tsl2561_sched_next(tsl2561_sched *sched);
+/**
+ * @brief Monotonic clock used by the scheduler
+ *
+ * @return uint64_t Time in ms
+ */
+uint64_t tsl2561_sched_now_ms(void);
+/**
+ * @brief Monotonic clock used for duty cycle accounting
+ *
+ * @return uint64_t Time in us
+ */
+uint64_t tsl2561_sched_now_us(void);
+#ifdef __cplusplus
+}
+#endif
+#endif // TSL2561_SCHED_H
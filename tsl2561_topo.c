@@ -0,0 +1,315 @@
+/**
+ * @file tsl2561_topo.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Discovery and caching of TSL2561 devices behind a TCA9458A mux
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "tsl2561_topo.h"
+#include "i2cbus/i2cbus.h"
+
+#define eprintf(str, ...) \
+    fprintf(stderr, "%s, %d: " str "\n", __func__, __LINE__, ##__VA_ARGS__); \
+    fflush(stderr)
+
+static const uint8_t tsl2561_topo_addr[] = {TSL2561_ADDR_LOW, TSL2561_ADDR_FLOAT, TSL2561_ADDR_HIGH};
+
+static inline int tsl2561_topo_mux_chn(uint8_t chn)
+{
+    return chn == TSL2561_TOPO_NOMUX ? TSL2561_TOPO_MUX_OFF : chn;
+}
+
+static int tsl2561_topo_select(tca9458a *mux, i2carb_client *cl, uint8_t chn)
+{
+    if (cl != NULL) // the arbiter switches the mux with each transfer
+        return 1;
+    if (tca9458a_set(mux, tsl2561_topo_mux_chn(chn)) < 0)
+    {
+        eprintf("Error: Could not set mux channel %d", chn);
+        return -1;
+    }
+    return 1;
+}
+
+static int tsl2561_topo_probe(tsl2561 *dev, i2carb_client *cl, uint8_t chn)
+{
+    if (cl != NULL)
+        return tsl2561_probe_arb(dev, cl, tsl2561_topo_mux_chn(chn));
+    return tsl2561_probe(dev);
+}
+
+int tsl2561_topo_scan(tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl, int bus, int mux_addr)
+{
+    // one handle per address, reused across channels
+    tsl2561 dev[3];
+    uint8_t trunk[3] = {0, 0, 0};
+    int status = -1;
+    int nopen = 0;
+    memset(topo, 0, sizeof(tsl2561_topo));
+    topo->bus = bus;
+    topo->mux_addr = mux_addr;
+    for (nopen = 0; nopen < 3; nopen++)
+    {
+        if (i2cbus_open(&(dev[nopen]), bus, tsl2561_topo_addr[nopen]) < 0)
+        {
+            eprintf("Error: Failed to open I2C Bus %d address 0x%02x", bus, tsl2561_topo_addr[nopen]);
+            goto close;
+        }
+    }
+    for (int chn = -1; chn < TSL2561_TOPO_NUM_CHN; chn++)
+    {
+        uint8_t c = chn < 0 ? TSL2561_TOPO_NOMUX : chn;
+        if (tsl2561_topo_select(mux, cl, c) < 0)
+            goto close;
+        for (int i = 0; i < 3; i++)
+        {
+            if (trunk[i])
+                continue;
+            int found = tsl2561_topo_probe(&(dev[i]), cl, c);
+            if (found < 0)
+                goto close;
+            if (found)
+            {
+                topo->ent[topo->num].chn = c;
+                topo->ent[topo->num].addr = tsl2561_topo_addr[i];
+                topo->num++;
+                if (chn < 0)
+                    trunk[i] = 1;
+            }
+        }
+    }
+    status = topo->num;
+close:
+    for (int i = 0; i < nopen; i++)
+        i2cbus_close(&(dev[i]));
+    return status;
+}
+
+int tsl2561_topo_verify(const tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl)
+{
+    tsl2561 dev[3];
+    int status = 1;
+    int nopen = 0;
+    for (nopen = 0; nopen < 3; nopen++)
+    {
+        if (i2cbus_open(&(dev[nopen]), topo->bus, tsl2561_topo_addr[nopen]) < 0)
+        {
+            eprintf("Error: Failed to open I2C Bus %d address 0x%02x", topo->bus, tsl2561_topo_addr[nopen]);
+            status = -1;
+            goto close;
+        }
+    }
+    int cur_chn = -1;
+    for (int i = 0; i < topo->num; i++)
+    {
+        const tsl2561_topo_entry *ent = &(topo->ent[i]);
+        int idx = (ent->addr - TSL2561_ADDR_LOW) >> 4; // 0x29, 0x39, 0x49 -> 0, 1, 2
+        if (ent->chn != cur_chn)
+        {
+            if (tsl2561_topo_select(mux, cl, ent->chn) < 0)
+            {
+                status = -1;
+                goto close;
+            }
+            cur_chn = ent->chn;
+        }
+        int found = tsl2561_topo_probe(&(dev[idx]), cl, ent->chn);
+        if (found < 0)
+        {
+            status = -1;
+            goto close;
+        }
+        if (!found)
+        {
+            eprintf("Device at channel %d address 0x%02x did not respond", ent->chn, ent->addr);
+            status = 0;
+            goto close;
+        }
+    }
+close:
+    for (int i = 0; i < nopen; i++)
+        i2cbus_close(&(dev[i]));
+    return status;
+}
+
+static uint16_t tsl2561_topo_fletcher16(const uint8_t *buf, int len)
+{
+    uint16_t s1 = 0, s2 = 0;
+    for (int i = 0; i < len; i++)
+    {
+        s1 = (s1 + buf[i]) % 255;
+        s2 = (s2 + s1) % 255;
+    }
+    return (s2 << 8) | s1;
+}
+
+int tsl2561_topo_save(const tsl2561_topo *topo, const char *path)
+{
+    uint8_t buf[8 + 2 * TSL2561_TOPO_MAX + 2];
+    int len = 0;
+    memcpy(buf, TSL2561_TOPO_MAGIC, 4);
+    len += 4;
+    buf[len++] = TSL2561_TOPO_VERSION;
+    buf[len++] = topo->bus;
+    buf[len++] = topo->mux_addr;
+    buf[len++] = topo->num;
+    for (int i = 0; i < topo->num; i++)
+    {
+        buf[len++] = topo->ent[i].chn;
+        buf[len++] = topo->ent[i].addr;
+    }
+    uint16_t sum = tsl2561_topo_fletcher16(buf, len);
+    buf[len++] = sum;
+    buf[len++] = sum >> 8;
+
+    char tmp[strlen(path) + 5];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL)
+    {
+        eprintf("Error: Could not open %s for writing", tmp);
+        return -1;
+    }
+    if (fwrite(buf, 1, len, fp) != (size_t)len)
+    {
+        eprintf("Error: Could not write %s", tmp);
+        fclose(fp);
+        remove(tmp);
+        return -1;
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+    {
+        eprintf("Error: Could not commit %s", path);
+        remove(tmp);
+        return -1;
+    }
+    return 1;
+}
+
+int tsl2561_topo_load(tsl2561_topo *topo, const char *path)
+{
+    uint8_t buf[8 + 2 * TSL2561_TOPO_MAX + 2 + 1];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    int len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    if (len < 10 || memcmp(buf, TSL2561_TOPO_MAGIC, 4) || buf[4] != TSL2561_TOPO_VERSION)
+    {
+        eprintf("%s is not a topology cache", path);
+        return -1;
+    }
+    int num = buf[7];
+    if (num > TSL2561_TOPO_MAX || len != 8 + 2 * num + 2)
+    {
+        eprintf("%s has invalid length %d for %d devices", path, len, num);
+        return -1;
+    }
+    uint16_t sum = buf[len - 2] | (buf[len - 1] << 8);
+    if (sum != tsl2561_topo_fletcher16(buf, len - 2))
+    {
+        eprintf("%s checksum mismatch", path);
+        return -1;
+    }
+    memset(topo, 0, sizeof(tsl2561_topo));
+    topo->bus = buf[5];
+    topo->mux_addr = buf[6];
+    topo->num = num;
+    for (int i = 0; i < num; i++)
+    {
+        uint8_t chn = buf[8 + 2 * i];
+        uint8_t addr = buf[8 + 2 * i + 1];
+        if ((chn >= TSL2561_TOPO_NUM_CHN && chn != TSL2561_TOPO_NOMUX) ||
+            !((addr == TSL2561_ADDR_LOW) || (addr == TSL2561_ADDR_FLOAT) || (addr == TSL2561_ADDR_HIGH)))
+        {
+            eprintf("%s has invalid entry %d: channel %d address 0x%02x", path, i, chn, addr);
+            return -1;
+        }
+        topo->ent[i].chn = chn;
+        topo->ent[i].addr = addr;
+    }
+    return 1;
+}
+
+int tsl2561_topo_discover(tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl, int bus, int mux_addr, const char *path, int rescan)
+{
+    // an empty cache is a miss, sensors may have been powered up since
+    if (!rescan && (tsl2561_topo_load(topo, path) > 0) && (topo->num > 0) && (topo->bus == bus) && (topo->mux_addr == mux_addr))
+    {
+        int status = tsl2561_topo_verify(topo, mux, cl);
+        if (status < 0)
+            return -1;
+        if (status > 0)
+            return 1;
+        eprintf("Cached topology in %s is stale, rescanning", path);
+    }
+    if (tsl2561_topo_scan(topo, mux, cl, bus, mux_addr) < 0)
+        return -1;
+    if (topo->num == 0) // do not pin an empty bus for the next boot
+        return 0;
+    if (tsl2561_topo_save(topo, path) < 0)
+    {
+        eprintf("Could not save topology to %s, next boot will rescan", path);
+    }
+    return 0;
+}
+
+int tsl2561_topo_open(const tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl, tsl2561 *devs, tsl2561_sched_dev *ents)
+{
+    int num = 0;
+    int cur_chn = -1;
+    for (int i = 0; i < topo->num; i++)
+    {
+        const tsl2561_topo_entry *ent = &(topo->ent[i]);
+        if (ent->chn != cur_chn)
+        {
+            // keep the devices opened so far, the caller closes them
+            if (tsl2561_topo_select(mux, cl, ent->chn) < 0)
+                break;
+            cur_chn = ent->chn;
+        }
+        int status = cl == NULL ? tsl2561_init(&(devs[num]), topo->bus, ent->addr, 0)
+                                : tsl2561_init_arb(&(devs[num]), cl, tsl2561_topo_mux_chn(ent->chn), topo->bus, ent->addr, 0);
+        if (status < 0)
+        {
+            // init powers the device down and closes the handle on failure
+            eprintf("Could not open 0x%02x chn %d", ent->addr, ent->chn);
+            continue;
+        }
+        ents[num].dev = &(devs[num]);
+        ents[num].chn = ent->chn == TSL2561_TOPO_NOMUX ? -1 : ent->chn;
+        num++;
+    }
+    return num;
+}
+
+int tsl2561_topo_close(tsl2561_sched_dev *ents, int num, tca9458a *mux, i2carb_client *cl)
+{
+    int status = 1;
+    int cur_chn = -2;
+    for (int i = 0; i < num; i++)
+    {
+        if (ents[i].chn != cur_chn)
+        {
+            if (tsl2561_topo_select(mux, cl, ents[i].chn < 0 ? TSL2561_TOPO_NOMUX : ents[i].chn) < 0)
+            {
+                // cannot power it down, release the handle anyway
+                i2cbus_close(ents[i].dev);
+                status = -1;
+                continue;
+            }
+            cur_chn = ents[i].chn;
+        }
+        int ret = cl != NULL ? tsl2561_destroy_arb(ents[i].dev, cl, ents[i].chn < 0 ? TSL2561_TOPO_MUX_OFF : ents[i].chn)
+                             : tsl2561_destroy(ents[i].dev);
+        if (ret < 0)
+            status = -1;
+    }
+    return status;
+}
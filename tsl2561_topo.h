@@ -0,0 +1,142 @@
+/**
+ * @file tsl2561_topo.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Discovery and caching of TSL2561 devices behind a TCA9458A mux
+ * @version 0.1
+ * @date 2020-03-19
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+
+#ifndef TSL2561_TOPO_H
+#define TSL2561_TOPO_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include "tsl2561.h"
+#include "tsl2561_sched.h"
+#include <tca9458a/tca9458a.h>
+
+#define TSL2561_TOPO_NUM_CHN (8)                              ///< Channels on a TCA9458A
+#define TSL2561_TOPO_MUX_OFF (8)                              ///< tca9458a_set channel that disables all outputs
+#define TSL2561_TOPO_NOMUX (0xff)                             ///< Channel of a device not behind the mux
+#define TSL2561_TOPO_MAX ((TSL2561_TOPO_NUM_CHN + 1) * 3)     ///< 3 addresses on the trunk and on each channel
+#define TSL2561_TOPO_MAGIC "TSLT"                             ///< Cache file magic
+#define TSL2561_TOPO_VERSION (1)                              ///< Cache file format version
+
+#ifndef TSL2561_TOPO_CACHE
+#define TSL2561_TOPO_CACHE "tsl2561_topo.bin" ///< Default cache file path
+#endif
+
+/**
+ * @brief Location of one device on the bus
+ *
+ */
+typedef struct
+{
+    uint8_t chn;  ///< Mux channel, TSL2561_TOPO_NOMUX if on the trunk
+    uint8_t addr; ///< One of TSL2561_ADDR_*
+} tsl2561_topo_entry;
+
+/**
+ * @brief Topology table, entries ordered by channel with trunk devices first.
+ * The cache file stores the header fields and entries as bytes, followed by a
+ * Fletcher-16 checksum: magic[4] version bus mux_addr num {chn addr}[num] sum[2]
+ *
+ */
+typedef struct
+{
+    uint8_t bus;                               ///< I2C Bus ID
+    uint8_t mux_addr;                          ///< Mux address
+    uint8_t num;                               ///< Number of devices found
+    tsl2561_topo_entry ent[TSL2561_TOPO_MAX];  ///< Device locations
+} tsl2561_topo;
+
+/**
+ * @brief Scan the trunk (mux disabled) and every mux channel for the three
+ * TSL2561 addresses. Addresses found on the trunk are not probed again behind
+ * the mux, as they would answer on every channel.
+ *
+ * @param topo Topology table to fill
+ * @param mux Initialized mux handle
+ * @param cl Arbiter client, NULL to access the bus and mux directly
+ * @param bus I2C Bus ID
+ * @param mux_addr Address of the mux
+ * @return int Number of devices found, -1 on bus error
+ */
+int tsl2561_topo_scan(tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl, int bus, int mux_addr);
+/**
+ * @brief Probe only the devices listed in topo
+ *
+ * @param topo Topology table, e.g. from tsl2561_topo_load
+ * @param mux Initialized mux handle
+ * @param cl Arbiter client, NULL to access the bus and mux directly
+ * @return int 1 if every device answered, 0 if any is missing, -1 on bus error
+ */
+int tsl2561_topo_verify(const tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl);
+/**
+ * @brief Save topology table to file
+ *
+ * @param topo Topology table
+ * @param path Cache file path, written to path.tmp first and renamed
+ * @return int 1 on success, -1 on failure
+ */
+int tsl2561_topo_save(const tsl2561_topo *topo, const char *path);
+/**
+ * @brief Load topology table from file
+ *
+ * @param topo Topology table to fill
+ * @param path Cache file path
+ * @return int 1 on success, -1 if the file is missing or corrupt
+ */
+int tsl2561_topo_load(tsl2561_topo *topo, const char *path);
+/**
+ * @brief Load and verify the cached topology, falling back to a full scan
+ * (and rewriting the cache) if the cache is missing, empty, belongs to a
+ * different bus/mux, or any cached device fails to answer. A scan that finds
+ * no device is not cached.
+ *
+ * Only the cached devices are probed on a cache hit, so a sensor added on a
+ * free address or channel is not found until the next rescan. Pass rescan = 1
+ * after adding or moving a sensor (or delete the cache file).
+ *
+ * @param topo Topology table to fill
+ * @param mux Initialized mux handle
+ * @param cl Arbiter client, NULL to access the bus and mux directly
+ * @param bus I2C Bus ID
+ * @param mux_addr Address of the mux
+ * @param path Cache file path
+ * @param rescan 1 to ignore the cache and scan, 0 to use the cache if it verifies
+ * @return int 1 on a verified cache hit, 0 after a rescan, -1 on bus error
+ */
+int tsl2561_topo_discover(tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl, int bus, int mux_addr, const char *path, int rescan);
+/**
+ * @brief Initialize every device in the topology and fill scheduler entries
+ * for those that came up. Entries are compacted, failed devices are skipped.
+ *
+ * @param topo Topology table
+ * @param mux Initialized mux handle
+ * @param cl Arbiter client, NULL to access the bus and mux directly
+ * @param devs Array of at least topo->num device handles
+ * @param ents Array of at least topo->num scheduler entries
+ * @return int Number of devices initialized. On a mux error the devices opened
+ * so far are returned, and must still be closed with tsl2561_topo_close.
+ */
+int tsl2561_topo_open(const tsl2561_topo *topo, tca9458a *mux, i2carb_client *cl, tsl2561 *devs, tsl2561_sched_dev *ents);
+/**
+ * @brief Power down and close devices opened by tsl2561_topo_open. Devices
+ * behind a channel that cannot be selected are closed without power down.
+ *
+ * @param ents Scheduler entries filled by tsl2561_topo_open
+ * @param num Number of entries
+ * @param mux Initialized mux handle
+ * @param cl Arbiter client, NULL to access the bus and mux directly
+ * @return int 1 on success, -1 if any device could not be powered down
+ */
+int tsl2561_topo_close(tsl2561_sched_dev *ents, int num, tca9458a *mux, i2carb_client *cl);
+#ifdef __cplusplus
+}
+#endif
+#endif // TSL2561_TOPO_H